@@ -5,6 +5,27 @@
 
 using namespace Rcpp;
 
+// popcount_kernel
+std::string popcount_kernel();
+RcppExport SEXP _morgancpp_popcount_kernel() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(popcount_kernel());
+    return rcpp_result_gen;
+END_RCPP
+}
+// huge_pages
+std::string huge_pages(const std::string& mode);
+RcppExport SEXP _morgancpp_huge_pages(SEXP modeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type mode(modeSEXP);
+    rcpp_result_gen = Rcpp::wrap(huge_pages(mode));
+    return rcpp_result_gen;
+END_RCPP
+}
 // tanimoto
 double tanimoto(const CharacterVector& s1, const CharacterVector& s2);
 RcppExport SEXP _morgancpp_tanimoto(SEXP s1SEXP, SEXP s2SEXP) {
@@ -17,12 +38,26 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// read_pairs_file
+DataFrame read_pairs_file(const std::string& path);
+RcppExport SEXP _morgancpp_read_pairs_file(SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    rcpp_result_gen = Rcpp::wrap(read_pairs_file(path));
+    return rcpp_result_gen;
+END_RCPP
+}
 
 RcppExport SEXP _rcpp_module_boot_morgan_identity_cpp();
 RcppExport SEXP _rcpp_module_boot_morgan_cpp();
 
 static const R_CallMethodDef CallEntries[] = {
+    {"_morgancpp_popcount_kernel", (DL_FUNC) &_morgancpp_popcount_kernel, 0},
+    {"_morgancpp_huge_pages", (DL_FUNC) &_morgancpp_huge_pages, 1},
     {"_morgancpp_tanimoto", (DL_FUNC) &_morgancpp_tanimoto, 2},
+    {"_morgancpp_read_pairs_file", (DL_FUNC) &_morgancpp_read_pairs_file, 1},
     {"_rcpp_module_boot_morgan_identity_cpp", (DL_FUNC) &_rcpp_module_boot_morgan_identity_cpp, 0},
     {"_rcpp_module_boot_morgan_cpp", (DL_FUNC) &_rcpp_module_boot_morgan_cpp, 0},
     {NULL, NULL, 0}
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "kernels.hpp"
+#include "memory.hpp"
+
+#ifndef MORGANCPP_BITSLICE_H
+#define MORGANCPP_BITSLICE_H
+
+
+// Fingerprints stored column-major as bit planes, in groups of 512. Plane b of
+// a group is one 64 byte line with bit k set if fingerprint k of the group has
+// bit b, so a query is compared against a whole group by adding up only the
+// planes of its own set bits into bit-sliced counters, 512 fingerprints at a
+// time. Sparse queries touch a small fraction of the memory the full
+// fingerprints take.
+//
+// Groups follow a given order of the fingerprints, the popcount order of the
+// collection, so that the popcount window of a threshold search is a
+// contiguous range of groups. Query bits are added from the rarest to the most
+// common in the collection, and every few planes a group is abandoned if no
+// fingerprint in it can still reach the number of shared bits the threshold
+// requires.
+class BitSlices {
+
+public:
+
+  static const size_t group_size = 512;
+  static const size_t plane_words = group_size / 64;
+
+  // Bits per fingerprint and number of fingerprints
+  size_t n_bits = 0;
+  size_t n = 0;
+  // Plane of bit b of group g at planes[(g * n_bits + b) * plane_words]
+  AlignedVector<std::uint64_t> planes;
+  // Number of fingerprints with each bit set
+  std::vector<std::uint32_t> bit_counts;
+
+  bool empty() const {
+    return n_bits == 0;
+  }
+
+  size_t size() const {
+    return planes.size() * sizeof(std::uint64_t) + bit_counts.size() * sizeof(std::uint32_t);
+  }
+
+  template <typename Fps>
+  void build(const Fps& fps, const std::vector<std::uint32_t>& order) {
+    using Fp = typename Fps::value_type;
+    n_bits = sizeof(Fp) * 8;
+    n = order.size();
+    const size_t n_groups = (n + group_size - 1) / group_size;
+    planes.assign(n_groups * n_bits * plane_words, 0);
+    bit_counts.assign(n_bits, 0);
+    for (size_t p = 0; p < n; p++) {
+      std::uint64_t* group = &planes[p / group_size * n_bits * plane_words];
+      const std::uint64_t lane = std::uint64_t(1) << (p % 64);
+      const Fp& fp = fps[order[p]];
+      for (size_t w = 0; w < fp.size(); w++) {
+        for (std::uint64_t x = fp[w]; x != 0; x &= x - 1) {
+          const size_t b = w * 64 + __builtin_ctzll(x);
+          group[b * plane_words + p % group_size / 64] |= lane;
+          bit_counts[b]++;
+        }
+      }
+    }
+  }
+
+  void clear() {
+    n_bits = 0;
+    n = 0;
+    planes.clear();
+    planes.shrink_to_fit();
+    bit_counts.clear();
+    bit_counts.shrink_to_fit();
+  }
+
+  // Set bits of a query, from the rarest to the most common in the collection
+  template <typename Fp>
+  std::vector<std::uint32_t> query_bits(const Fp& fp) const {
+    std::vector<std::uint32_t> bits;
+    for (size_t w = 0; w < fp.size(); w++) {
+      for (std::uint64_t x = fp[w]; x != 0; x &= x - 1)
+        bits.push_back(w * 64 + __builtin_ctzll(x));
+    }
+    std::stable_sort(bits.begin(), bits.end(), [&](std::uint32_t a, std::uint32_t b) {
+      return bit_counts[a] < bit_counts[b];
+    });
+    return bits;
+  }
+
+  // Calls f(p, count_and) with the number of bits shared by the query and the
+  // fingerprint at every position p in [begin, end) of the order the slices
+  // were built in. min_shared(p_begin, p_end) is the fewest shared bits any
+  // position in [p_begin, p_end) needs, groups that can't reach it are skipped
+  // without calling f.
+  template <typename MinShared, typename F>
+  void count_and(
+      const std::vector<std::uint32_t>& bits, size_t begin, size_t end,
+      MinShared min_shared, F f
+  ) const {
+    const size_t check_every = 8;
+    const auto add_planes = bitslice_kernels().add_planes;
+    int depth = 1;
+    while ((size_t(1) << depth) <= bits.size())
+      depth++;
+    std::vector<std::uint64_t> counters(depth * plane_words);
+    int counts[group_size];
+    for (size_t g = begin / group_size; g * group_size < end; g++) {
+      const size_t p_begin = std::max(begin, g * group_size);
+      const size_t p_end = std::min(end, (g + 1) * group_size);
+      const std::uint64_t* group = &planes[g * n_bits * plane_words];
+      // Lanes of the group inside [begin, end)
+      std::uint64_t mask[plane_words];
+      for (size_t w = 0; w < plane_words; w++) {
+        const size_t lo = g * group_size + w * 64;
+        const size_t from = std::min<size_t>(64, p_begin > lo ? p_begin - lo : 0);
+        const size_t to = std::min<size_t>(64, p_end > lo ? p_end - lo : 0);
+        mask[w] = lane_range(from, to);
+      }
+      const int needed = min_shared(p_begin, p_end);
+      std::fill(counters.begin(), counters.end(), 0);
+      bool rejected = false;
+      for (size_t i = 0; i < bits.size() && !rejected; i += check_every) {
+        const size_t n_planes = std::min(check_every, bits.size() - i);
+        add_planes(group, &bits[i], n_planes, counters.data(), depth);
+        const int remaining = bits.size() - i - n_planes;
+        rejected = needed > remaining && max_count(counters, depth, mask) < needed - remaining;
+      }
+      if (rejected)
+        continue;
+      // Counts of the lanes, from the bits set in each counter word
+      std::fill(counts, counts + group_size, 0);
+      for (int d = 0; d < depth; d++) {
+        for (size_t w = 0; w < plane_words; w++) {
+          for (std::uint64_t x = counters[d * plane_words + w] & mask[w]; x != 0; x &= x - 1)
+            counts[w * 64 + __builtin_ctzll(x)] += 1 << d;
+        }
+      }
+      for (size_t p = p_begin; p < p_end; p++)
+        f(p, counts[p % group_size]);
+    }
+  }
+
+private:
+
+  static std::uint64_t lane_range(size_t from, size_t to) {
+    if (from >= to)
+      return 0;
+    const std::uint64_t below_to = to == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << to) - 1;
+    return below_to & ~((std::uint64_t(1) << from) - 1);
+  }
+
+  // Largest count of the masked lanes, found from the highest counter bit down
+  static int max_count(
+      const std::vector<std::uint64_t>& counters, int depth, const std::uint64_t* mask
+  ) {
+    std::uint64_t candidates[plane_words];
+    std::copy(mask, mask + plane_words, candidates);
+    int max = 0;
+    for (int d = depth - 1; d >= 0; d--) {
+      std::uint64_t any = 0;
+      for (size_t w = 0; w < plane_words; w++)
+        any |= candidates[w] & counters[d * plane_words + w];
+      if (any == 0)
+        continue;
+      max |= 1 << d;
+      for (size_t w = 0; w < plane_words; w++)
+        candidates[w] &= counters[d * plane_words + w];
+    }
+    return max;
+  }
+};
+
+#endif
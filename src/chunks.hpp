@@ -0,0 +1,208 @@
+#include <Rcpp.h>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+#ifndef MORGANCPP_CHUNKS_H
+#define MORGANCPP_CHUNKS_H
+
+
+// Chunk table of a segment of a file saved by save_file(): the number of
+// fingerprints per chunk, the number of chunks and the compressed size of
+// each, followed by the chunks as independent zstd frames. Chunk c holds the
+// fingerprints at positions [c * chunk_size, (c + 1) * chunk_size) of the
+// segment.
+struct ChunkTable {
+  // Fingerprints in the segment
+  std::uint64_t n = 0;
+  std::uint64_t chunk_size = 0;
+  std::vector<std::uint64_t> sizes;
+  // Offsets of the chunks from the first one, and of the end of the last one
+  std::vector<size_t> offsets;
+  // File position of the first chunk
+  std::streampos start;
+
+  size_t n_chunks() const {
+    return sizes.size();
+  }
+
+  // Read the table of a segment holding n_ fingerprints, leaves the stream
+  // at the first chunk
+  void read(std::ifstream& in_stream, size_t n_) {
+    n = n_;
+    std::uint64_t n_chunks;
+    in_stream.read(reinterpret_cast<char*>(&chunk_size), sizeof(chunk_size));
+    in_stream.read(reinterpret_cast<char*>(&n_chunks), sizeof(n_chunks));
+    if (!in_stream)
+      Rcpp::stop("File is truncated");
+    if (chunk_size == 0 || n_chunks != (n + chunk_size - 1) / chunk_size)
+      Rcpp::stop("Chunk table doesn't match the number of fingerprints");
+    sizes.resize(n_chunks);
+    in_stream.read(reinterpret_cast<char*>(sizes.data()), n_chunks * sizeof(std::uint64_t));
+    if (!in_stream)
+      Rcpp::stop("File is truncated");
+    offsets.assign(n_chunks + 1, 0);
+    for (size_t c = 0; c < n_chunks; c++)
+      offsets[c + 1] = offsets[c] + sizes[c];
+    start = in_stream.tellg();
+  }
+};
+
+// Fingerprints of a file saved by save_file() read on demand. Only the chunks
+// holding requested fingerprints are decompressed, the most recently used
+// ones are kept in a cache of cache_chunks chunks. Positions are those of the
+// collection, which differ from those in the file if its segments were
+// merged.
+template <typename Fp>
+class LazyChunks {
+
+public:
+
+  static const size_t cache_chunks = 8;
+
+  bool empty() const {
+    return !in_stream;
+  }
+
+  const std::string& path() const {
+    return path_;
+  }
+
+  // order holds the file position of every position of the collection, or
+  // nothing if they are the same
+  void open(
+      const std::string& path, const std::vector<ChunkTable>& segments_,
+      const std::vector<size_t>& order_
+  ) {
+    path_ = path;
+    segments = segments_;
+    order = order_;
+    segment_begin.assign(1, 0);
+    first_chunk.assign(1, 0);
+    for (auto& table: segments) {
+      segment_begin.push_back(segment_begin.back() + table.n);
+      first_chunk.push_back(first_chunk.back() + table.n_chunks());
+    }
+    in_stream = std::make_shared<std::ifstream>(path, std::ios::in | std::ios::binary);
+    if (!*in_stream)
+      Rcpp::stop("Can't open %s", path);
+    lru.clear();
+    cache.clear();
+  }
+
+  void close() {
+    in_stream.reset();
+    lru.clear();
+    cache.clear();
+  }
+
+  // Bytes of decompressed chunks in the cache
+  size_t cached_size() const {
+    size_t bytes = 0;
+    for (auto& c: cache)
+      bytes += c.second.first.size() * sizeof(Fp);
+    return bytes;
+  }
+
+  Fp get(size_t p) {
+    const Location l = locate(p);
+    return chunk(l.chunk)[l.index];
+  }
+
+  // Fingerprints at the given positions, reading each chunk holding any of
+  // them only once
+  std::vector<Fp> fetch(const std::vector<size_t>& positions) {
+    std::vector<Location> locations;
+    locations.reserve(positions.size());
+    for (auto p: positions)
+      locations.push_back(locate(p));
+    std::vector<size_t> by_chunk(positions.size());
+    std::iota(by_chunk.begin(), by_chunk.end(), 0);
+    std::sort(by_chunk.begin(), by_chunk.end(), [&](size_t a, size_t b) {
+      return locations[a].chunk < locations[b].chunk;
+    });
+    std::vector<Fp> out(positions.size());
+    const std::vector<Fp>* current = nullptr;
+    size_t current_chunk = 0;
+    for (auto k: by_chunk) {
+      if (current == nullptr || locations[k].chunk != current_chunk) {
+        current_chunk = locations[k].chunk;
+        current = &chunk(current_chunk);
+      }
+      out[k] = (*current)[locations[k].index];
+    }
+    return out;
+  }
+
+private:
+
+  std::string path_;
+  std::shared_ptr<std::ifstream> in_stream;
+  std::vector<ChunkTable> segments;
+  std::vector<size_t> order;
+  // File position of the first fingerprint and number of the first chunk of
+  // every segment, counting the chunks of all segments
+  std::vector<size_t> segment_begin;
+  std::vector<size_t> first_chunk;
+  // Cached chunks, the most recently used first
+  std::list<size_t> lru;
+  std::unordered_map<size_t, std::pair<std::vector<Fp>, std::list<size_t>::iterator>> cache;
+
+  struct Location {
+    size_t chunk, index;
+  };
+
+  // Chunk holding position p and the index of p in it
+  Location locate(size_t p) const {
+    const size_t f = order.empty() ? p : order[p];
+    const size_t s = std::upper_bound(segment_begin.begin(), segment_begin.end(), f) - segment_begin.begin() - 1;
+    const size_t i = f - segment_begin[s];
+    return {first_chunk[s] + i / segments[s].chunk_size, i % segments[s].chunk_size};
+  }
+
+  // Decompressed chunk c, counting the chunks of all segments, valid until
+  // the next call
+  const std::vector<Fp>& chunk(size_t c) {
+    auto hit = cache.find(c);
+    if (hit != cache.end()) {
+      lru.splice(lru.begin(), lru, hit->second.second);
+      return hit->second.first;
+    }
+    if (cache.size() >= cache_chunks) {
+      cache.erase(lru.back());
+      lru.pop_back();
+    }
+    const size_t s = std::upper_bound(first_chunk.begin(), first_chunk.end(), c) - first_chunk.begin() - 1;
+    const ChunkTable& table = segments[s];
+    const size_t local = c - first_chunk[s];
+    std::vector<char> compressed(table.sizes[local]);
+    in_stream->clear();
+    in_stream->seekg(table.start + static_cast<std::streamoff>(table.offsets[local]));
+    in_stream->read(compressed.data(), compressed.size());
+    if (!*in_stream)
+      Rcpp::stop("File is truncated");
+    const size_t begin = local * table.chunk_size;
+    const size_t end = std::min<size_t>(table.n, begin + table.chunk_size);
+    std::vector<Fp> fps(end - begin);
+    zstd_decompress_chunk(
+      compressed.data(), compressed.size(),
+      reinterpret_cast<char*>(fps.data()), fps.size() * sizeof(Fp)
+    );
+    lru.push_front(c);
+    auto& entry = cache[c];
+    entry.first.swap(fps);
+    entry.second = lru.begin();
+    return entry.first;
+  }
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include <Rcpp.h>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+#include "hnsw.hpp"
+
+using namespace Rcpp;
+
+namespace {
+
+const char hnsw_file_magic[] = "MORGANNSW";
+const std::uint32_t hnsw_file_version = 1;
+
+}
+
+void HnswIndex::save(const std::string& path, int compression_level) const {
+  if (compression_level < 1 || compression_level > 22)
+    stop("Compression level must be between 0 and 22. Default = 3");
+  std::ofstream out_stream;
+  out_stream.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out_stream)
+    stop("Can't open %s for writing", path);
+  const std::uint64_t n_fps = n;
+  const std::uint64_t n_upper = upper_links.size();
+  const std::int32_t params[] = {M, ef_construction, max_level};
+  out_stream.write(hnsw_file_magic, 9);
+  out_stream.write(reinterpret_cast<const char*>(&hnsw_file_version), sizeof(hnsw_file_version));
+  out_stream.write(reinterpret_cast<const char*>(&n_fps), sizeof(n_fps));
+  out_stream.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+  out_stream.write(reinterpret_cast<const char*>(&seed), sizeof(seed));
+  out_stream.write(reinterpret_cast<const char*>(params), sizeof(params));
+  out_stream.write(reinterpret_cast<const char*>(&entry_point), sizeof(entry_point));
+  out_stream.write(reinterpret_cast<const char*>(&n_upper), sizeof(n_upper));
+  zstd_write_block(out_stream, reinterpret_cast<const char*>(levels.data()), levels.size(), compression_level);
+  zstd_write_block(
+    out_stream, reinterpret_cast<const char*>(links0.data()),
+    links0.size() * sizeof(std::uint32_t), compression_level
+  );
+  zstd_write_block(
+    out_stream, reinterpret_cast<const char*>(upper_links.data()),
+    upper_links.size() * sizeof(std::uint32_t), compression_level
+  );
+  out_stream.close();
+  if (out_stream.fail())
+    stop("Error writing index file %s", path);
+}
+
+void HnswIndex::load(const std::string& path) {
+  std::ifstream in_stream;
+  in_stream.open(path, std::ios::in | std::ios::binary);
+  if (!in_stream)
+    stop("Can't open %s", path);
+  char magic[] = "xORGANNSW";
+  in_stream.read(magic, 9);
+  if (strcmp(magic, hnsw_file_magic) != 0)
+    stop("File is incompatible, doesn't start with 'MORGANNSW': '%s'", magic);
+  std::uint32_t version;
+  std::uint64_t n_fps, n_upper;
+  std::int32_t params[3];
+  in_stream.read(reinterpret_cast<char*>(&version), sizeof(version));
+  if (version != hnsw_file_version)
+    stop("Unsupported index file version %i", version);
+  in_stream.read(reinterpret_cast<char*>(&n_fps), sizeof(n_fps));
+  in_stream.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+  in_stream.read(reinterpret_cast<char*>(&seed), sizeof(seed));
+  in_stream.read(reinterpret_cast<char*>(params), sizeof(params));
+  in_stream.read(reinterpret_cast<char*>(&entry_point), sizeof(entry_point));
+  in_stream.read(reinterpret_cast<char*>(&n_upper), sizeof(n_upper));
+  if (!in_stream)
+    stop("Index file %s is truncated", path);
+  n = n_fps;
+  M = params[0];
+  ef_construction = params[1];
+  max_level = params[2];
+  // M bounds the size of the links, so it is checked before allocating them
+  if (M < 2 || M > 256 || n > UINT32_MAX)
+    stop("Index file %s is inconsistent", path);
+  levels.resize(n);
+  zstd_read_block(in_stream, reinterpret_cast<char*>(levels.data()), levels.size());
+  allocate_links();
+  if (upper_links.size() != n_upper)
+    stop("Index file %s is inconsistent", path);
+  zstd_read_block(in_stream, reinterpret_cast<char*>(links0.data()), links0.size() * sizeof(std::uint32_t));
+  zstd_read_block(in_stream, reinterpret_cast<char*>(upper_links.data()), upper_links.size() * sizeof(std::uint32_t));
+  if (!consistent())
+    stop("Index file %s is inconsistent", path);
+}
+
+// Searches follow links without bounds checks: the entry point has to be on
+// the top level, and every link has to point to a node on its level
+bool HnswIndex::consistent() const {
+  if (n == 0)
+    return max_level == -1;
+  if (entry_point >= n || max_level < 0 || levels[entry_point] != max_level)
+    return false;
+  for (size_t i = 0; i < n; i++) {
+    if (levels[i] > max_level)
+      return false;
+    for (int level = 0; level <= levels[i]; level++) {
+      const std::uint32_t* l = links(i, level);
+      if (l[0] > max_links(level))
+        return false;
+      for (std::uint32_t k = 1; k <= l[0]; k++) {
+        if (l[k] >= n || levels[l[k]] < level)
+          return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "parallel.hpp"
+#include "utils.hpp"
+
+#ifndef MORGANCPP_HNSW_H
+#define MORGANCPP_HNSW_H
+
+
+// Hierarchical navigable small world graph (Malkov & Yashunin 2018) for
+// approximate nearest neighbour search.
+//
+// Every node is assigned a random level with exponentially decreasing
+// probability and is linked to up to M of its nearest neighbours on each of its
+// levels, 2 * M on level 0. Searches descend greedily from the single node on
+// the top level and run a best first search with a candidate list of ef nodes
+// on level 0. Larger ef raises the recall at the cost of more comparisons.
+//
+// The graph only stores node positions, distances are computed by the caller:
+// dist(j) from the query to node j, and node_dist(i, j) between two nodes.
+// Nodes are inserted in parallel, each node's links are guarded by one of a
+// fixed set of mutexes and only one of them is held at a time.
+class HnswIndex {
+
+public:
+
+  int M = 0;
+  int ef_construction = 0;
+  std::uint64_t seed = 0;
+  size_t n = 0;
+  // Hash of the fingerprints the index was built for
+  std::uint64_t checksum = 0;
+  int max_level = -1;
+  std::uint32_t entry_point = 0;
+  std::vector<std::uint8_t> levels;
+  // Links on level 0, a count followed by 2 * M slots for every node
+  std::vector<std::uint32_t> links0;
+  // Links on the levels above 0, a count followed by M slots for each level
+  // of a node. Only nodes with a level above 0 have them, starting at
+  // upper_links[upper_offsets[upper_index[i]]].
+  std::vector<std::uint32_t> upper_links;
+  std::vector<std::uint32_t> upper_index;
+  std::vector<size_t> upper_offsets;
+
+  using Neighbour = std::pair<double, std::uint32_t>;
+
+  bool empty() const {
+    return M == 0;
+  }
+
+  size_t size() const {
+    return levels.size() + (links0.size() + upper_links.size() + upper_index.size()) * sizeof(std::uint32_t) +
+      upper_offsets.size() * sizeof(size_t);
+  }
+
+  template <typename NodeDist>
+  void build(
+      size_t n_, int M_, int ef_construction_, std::uint64_t seed_,
+      std::uint64_t checksum_, int n_threads, NodeDist node_dist
+  ) {
+    M = M_;
+    ef_construction = ef_construction_;
+    seed = seed_;
+    n = n_;
+    checksum = checksum_;
+    max_level = -1;
+    entry_point = 0;
+    // Levels are drawn up front so that they don't depend on the order in
+    // which the workers insert the nodes
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const double level_mult = 1 / std::log(static_cast<double>(M));
+    levels.resize(n);
+    for (auto& l: levels)
+      l = std::min(255, static_cast<int>(-std::log(1 - uniform(rng)) * level_mult));
+    allocate_links();
+    if (n == 0)
+      return;
+
+    locks = std::make_shared<std::vector<std::mutex>>(n_locks);
+    entry_lock = std::make_shared<std::mutex>();
+    std::vector<VisitedTags> visited(n_threads);
+    insert(0, visited[0], node_dist);
+    const size_t chunk_size = 256;
+    parallel_for((n + chunk_size - 2) / chunk_size, n_threads, [&](size_t chunk, int worker) {
+      const size_t end = std::min(n, 1 + (chunk + 1) * chunk_size);
+      for (size_t i = 1 + chunk * chunk_size; i < end; i++)
+        insert(i, visited[worker], node_dist);
+    });
+    locks.reset();
+    entry_lock.reset();
+  }
+
+  // Tags marking the nodes visited by a search, reset by moving to the next
+  // epoch rather than clearing them
+  struct VisitedTags {
+    std::vector<std::uint16_t> tags;
+    std::uint16_t epoch = 0;
+
+    void next(size_t n) {
+      if (tags.size() != n)
+        tags.assign(n, 0);
+      if (++epoch == 0) {
+        std::fill(tags.begin(), tags.end(), 0);
+        epoch = 1;
+      }
+    }
+
+    bool visit(std::uint32_t i) {
+      if (tags[i] == epoch)
+        return false;
+      tags[i] = epoch;
+      return true;
+    }
+  };
+
+  // The k nearest nodes found with a candidate list of ef nodes, ordered by
+  // distance and position
+  template <typename Dist>
+  std::vector<Neighbour> search(Dist dist, size_t k, size_t ef, VisitedTags& visited) const {
+    if (n == 0)
+      return std::vector<Neighbour>();
+    std::uint32_t ep = entry_point;
+    double ep_dist = dist(ep);
+    for (int level = max_level; level > 0; level--)
+      greedy_step(dist, ep, ep_dist, level);
+    auto found = search_level(dist, ep, ep_dist, std::max(ef, k), 0, visited);
+    if (found.size() > k)
+      found.resize(k);
+    return found;
+  }
+
+  // Index files start with "MORGANNSW", a format version, the number of
+  // fingerprints, their checksum and the parameters of the graph, followed by
+  // the levels and links as zstd frames
+  void save(const std::string& path, int compression_level) const;
+  void load(const std::string& path);
+
+private:
+
+  bool consistent() const;
+
+  // Only allocated while the graph is built
+  static const size_t n_locks = 1 << 16;
+  std::shared_ptr<std::vector<std::mutex>> locks;
+  std::shared_ptr<std::mutex> entry_lock;
+
+  size_t max_links(int level) const {
+    return level == 0 ? 2 * M : M;
+  }
+
+  void allocate_links() {
+    links0.assign(n * (2 * M + 1), 0);
+    upper_index.assign(n, 0);
+    upper_offsets.assign(1, 0);
+    for (size_t i = 0; i < n; i++) {
+      if (levels[i] > 0) {
+        upper_index[i] = upper_offsets.size() - 1;
+        upper_offsets.push_back(upper_offsets.back() + levels[i] * (M + 1));
+      }
+    }
+    upper_links.assign(upper_offsets.back(), 0);
+  }
+
+  std::uint32_t* links(std::uint32_t i, int level) {
+    if (level == 0)
+      return &links0[static_cast<size_t>(i) * (2 * M + 1)];
+    return &upper_links[upper_offsets[upper_index[i]] + (level - 1) * (M + 1)];
+  }
+
+  const std::uint32_t* links(std::uint32_t i, int level) const {
+    return const_cast<HnswIndex*>(this)->links(i, level);
+  }
+
+  // Copy of the links of node i, taken under its lock during the build
+  void copy_links(std::uint32_t i, int level, std::vector<std::uint32_t>& out) const {
+    std::unique_lock<std::mutex> lock;
+    if (locks)
+      lock = std::unique_lock<std::mutex>((*locks)[i % n_locks]);
+    const std::uint32_t* l = links(i, level);
+    out.assign(l + 1, l + 1 + l[0]);
+  }
+
+  // Move to the nearest neighbour on the given level until there is no closer one
+  template <typename Dist>
+  void greedy_step(Dist dist, std::uint32_t& ep, double& ep_dist, int level) const {
+    std::vector<std::uint32_t> neighbours;
+    for (bool changed = true; changed;) {
+      changed = false;
+      copy_links(ep, level, neighbours);
+      for (auto j: neighbours) {
+        const double d = dist(j);
+        if (d < ep_dist) {
+          ep = j;
+          ep_dist = d;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  // Best first search on one level, returns up to ef nodes ordered by distance
+  template <typename Dist>
+  std::vector<Neighbour> search_level(
+      Dist dist, std::uint32_t ep, double ep_dist, size_t ef, int level, VisitedTags& visited
+  ) const {
+    visited.next(n);
+    visited.visit(ep);
+    std::priority_queue<Neighbour, std::vector<Neighbour>, std::greater<Neighbour>> candidates;
+    std::priority_queue<Neighbour> found;
+    candidates.emplace(ep_dist, ep);
+    found.emplace(ep_dist, ep);
+    std::vector<std::uint32_t> neighbours;
+    while (!candidates.empty()) {
+      const Neighbour c = candidates.top();
+      if (found.size() >= ef && c.first > found.top().first)
+        break;
+      candidates.pop();
+      copy_links(c.second, level, neighbours);
+      for (auto j: neighbours) {
+        if (!visited.visit(j))
+          continue;
+        const double d = dist(j);
+        if (found.size() < ef || d < found.top().first) {
+          candidates.emplace(d, j);
+          found.emplace(d, j);
+          if (found.size() > ef)
+            found.pop();
+        }
+      }
+    }
+    std::vector<Neighbour> out(found.size());
+    for (size_t k = out.size(); k-- > 0; found.pop())
+      out[k] = found.top();
+    return out;
+  }
+
+  // Neighbours kept by the heuristic of Malkov & Yashunin: a candidate is
+  // only linked if it's closer to the node than to every neighbour kept so
+  // far, which keeps links pointing in diverse directions
+  template <typename NodeDist>
+  std::vector<std::uint32_t> select_neighbours(
+      const std::vector<Neighbour>& candidates, size_t m, NodeDist node_dist
+  ) const {
+    std::vector<std::uint32_t> selected;
+    for (auto& c: candidates) {
+      if (selected.size() >= m)
+        break;
+      bool keep = true;
+      for (auto s: selected) {
+        if (node_dist(c.second, s) < c.first) {
+          keep = false;
+          break;
+        }
+      }
+      if (keep)
+        selected.push_back(c.second);
+    }
+    return selected;
+  }
+
+  template <typename NodeDist>
+  void insert(std::uint32_t q, VisitedTags& visited, NodeDist node_dist) {
+    const int level = levels[q];
+    // Nodes reaching above the current top level hold the entry lock until
+    // they are linked and become the new entry point
+    std::unique_lock<std::mutex> entry(*entry_lock);
+    const int top = max_level;
+    std::uint32_t ep = entry_point;
+    if (top < 0) {
+      entry_point = q;
+      max_level = level;
+      return;
+    }
+    if (level <= top)
+      entry.unlock();
+
+    auto dist = [&](std::uint32_t j) { return node_dist(q, j); };
+    double ep_dist = dist(ep);
+    for (int l = top; l > level; l--)
+      greedy_step(dist, ep, ep_dist, l);
+    for (int l = std::min(level, top); l >= 0; l--) {
+      const auto candidates = search_level(dist, ep, ep_dist, ef_construction, l, visited);
+      const auto selected = select_neighbours(candidates, M, node_dist);
+      {
+        std::lock_guard<std::mutex> lock((*locks)[q % n_locks]);
+        std::uint32_t* l_q = links(q, l);
+        l_q[0] = selected.size();
+        std::copy(selected.begin(), selected.end(), l_q + 1);
+      }
+      for (auto e: selected)
+        connect(e, q, l, node_dist);
+      ep = candidates[0].second;
+      ep_dist = candidates[0].first;
+    }
+    if (level > top) {
+      entry_point = q;
+      max_level = level;
+    }
+  }
+
+  // Add a link from node e to node q, pruning the links of e once it has
+  // reached the maximum number
+  template <typename NodeDist>
+  void connect(std::uint32_t e, std::uint32_t q, int level, NodeDist node_dist) {
+    std::lock_guard<std::mutex> lock((*locks)[e % n_locks]);
+    std::uint32_t* l_e = links(e, level);
+    const size_t m = max_links(level);
+    if (l_e[0] < m) {
+      l_e[1 + l_e[0]] = q;
+      l_e[0]++;
+      return;
+    }
+    std::vector<Neighbour> candidates;
+    candidates.reserve(m + 1);
+    candidates.emplace_back(node_dist(e, q), q);
+    for (size_t k = 1; k <= m; k++)
+      candidates.emplace_back(node_dist(e, l_e[k]), l_e[k]);
+    std::sort(candidates.begin(), candidates.end());
+    const auto selected = select_neighbours(candidates, m, node_dist);
+    l_e[0] = selected.size();
+    std::copy(selected.begin(), selected.end(), l_e + 1);
+  }
+};
+
+#endif
@@ -31,7 +31,7 @@ public:
   MorganMap(const CharacterVector& fps_hex) {
     auto n = fps_hex.length();
     auto format = guess_fp_format(fps_hex);
-    auto string_to_fp = select_fp_reader(format);
+    auto string_to_fp = select_fp_reader<2048>(format);
     RObject passed_names = fps_hex.names();
     fps.reserve(n);
     if(passed_names.isNULL()) {
@@ -49,7 +49,7 @@ public:
   DataFrame find_matches(const CharacterVector& fps_hex) {
     auto n = fps_hex.length();
     auto format = guess_fp_format(fps_hex);
-    auto string_to_fp = select_fp_reader(format);
+    auto string_to_fp = select_fp_reader<2048>(format);
     RObject passed_names = fps_hex.names();
     std::vector<FingerprintName> id_1;
     std::vector<FingerprintName> id_2;
@@ -0,0 +1,427 @@
+#include <Rcpp.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MORGANCPP_X86 1
+#include <immintrin.h>
+#else
+#define MORGANCPP_X86 0
+#endif
+
+#include "utils.hpp"
+#include "kernels.hpp"
+
+namespace {
+
+template <size_t W>
+using Words = std::array<std::uint64_t, W>;
+
+enum BitOp { BIT_AND, BIT_OR };
+
+template <BitOp op>
+inline std::uint64_t combine(std::uint64_t a, std::uint64_t b) {
+  return op == BIT_AND ? a & b : a | b;
+}
+
+// Intersection counts of a block of queries against a block of fingerprints.
+// Every fingerprint is compared against all queries before moving on, so the
+// queries are read from L1 cache. Flattened into a copy for each instruction
+// set so that the pair kernel is inlined as well.
+template <size_t W, int (*count_and)(const Words<W>&, const Words<W>&)>
+inline void count_and_block_loop(
+    const Words<W>* const* queries, size_t n_queries,
+    const Words<W>* const* fps, size_t n_fps, int* out
+) {
+  for (size_t j = 0; j < n_fps; j++) {
+    const Words<W>& fp = *fps[j];
+    for (size_t i = 0; i < n_queries; i++)
+      out[i * n_fps + j] = count_and(*queries[i], fp);
+  }
+}
+
+// Portable fallback, compiled without any instruction set extensions
+template <size_t W>
+int count_generic(const Words<W>& fp) {
+  int count = 0;
+  for (auto x: fp)
+    count += __builtin_popcountll(x);
+  return count;
+}
+
+template <BitOp op, size_t W>
+int count_op_generic(const Words<W>& f1, const Words<W>& f2) {
+  int count = 0;
+  for (size_t i = 0; i < W; i++)
+    count += __builtin_popcountll(combine<op>(f1[i], f2[i]));
+  return count;
+}
+
+template <size_t W>
+__attribute__((flatten))
+void count_and_block_generic(
+    const Words<W>* const* queries, size_t n_queries,
+    const Words<W>* const* fps, size_t n_fps, int* out
+) {
+  count_and_block_loop<W, count_op_generic<BIT_AND, W>>(queries, n_queries, fps, n_fps, out);
+}
+
+template <size_t W>
+const PopcountKernels<W> generic_kernels = {
+  "generic",
+  count_generic<W>,
+  count_op_generic<BIT_AND, W>,
+  count_op_generic<BIT_OR, W>,
+  count_and_block_generic<W>
+};
+
+// Bit-sliced counters are incremented by a ripple carry add of each plane,
+// which stops as soon as no lane carries any more. No popcount is needed, so
+// the popcnt instruction set uses the generic version as well.
+const size_t plane_words = 8;
+
+void add_planes_generic(
+    const std::uint64_t* planes, const std::uint32_t* bits, size_t n_planes,
+    std::uint64_t* counters, int depth
+) {
+  for (size_t i = 0; i < n_planes; i++) {
+    std::uint64_t carry[plane_words];
+    std::copy(planes + bits[i] * plane_words, planes + (bits[i] + 1) * plane_words, carry);
+    for (int d = 0; d < depth; d++) {
+      std::uint64_t any = 0;
+      for (size_t w = 0; w < plane_words; w++) {
+        std::uint64_t& c = counters[d * plane_words + w];
+        const std::uint64_t next = c & carry[w];
+        c ^= carry[w];
+        carry[w] = next;
+        any |= next;
+      }
+      if (any == 0)
+        break;
+    }
+  }
+}
+
+const BitSliceKernels generic_bitslice_kernels = {
+  "generic",
+  add_planes_generic
+};
+
+#if MORGANCPP_X86
+
+// Same loops as above, but compiled to use the hardware popcnt instruction
+template <size_t W>
+__attribute__((target("popcnt")))
+int count_popcnt(const Words<W>& fp) {
+  int count = 0;
+  for (auto x: fp)
+    count += __builtin_popcountll(x);
+  return count;
+}
+
+template <BitOp op, size_t W>
+__attribute__((target("popcnt")))
+int count_op_popcnt(const Words<W>& f1, const Words<W>& f2) {
+  int count = 0;
+  for (size_t i = 0; i < W; i++)
+    count += __builtin_popcountll(combine<op>(f1[i], f2[i]));
+  return count;
+}
+
+template <size_t W>
+__attribute__((target("popcnt"), flatten))
+void count_and_block_popcnt(
+    const Words<W>* const* queries, size_t n_queries,
+    const Words<W>* const* fps, size_t n_fps, int* out
+) {
+  count_and_block_loop<W, count_op_popcnt<BIT_AND, W>>(queries, n_queries, fps, n_fps, out);
+}
+
+template <size_t W>
+const PopcountKernels<W> popcnt_kernels = {
+  "popcnt",
+  count_popcnt<W>,
+  count_op_popcnt<BIT_AND, W>,
+  count_op_popcnt<BIT_OR, W>,
+  count_and_block_popcnt<W>
+};
+
+// AVX2 has no vector popcount. Count set bits of every byte using a 16 entry
+// lookup table for each nibble (Mula et al.), sum the byte counts over the
+// whole fingerprint and reduce them once at the end with vpsadbw.
+template <BitOp op>
+__attribute__((target("avx2")))
+inline __m256i combine_avx2(__m256i a, __m256i b) {
+  return op == BIT_AND ? _mm256_and_si256(a, b) : _mm256_or_si256(a, b);
+}
+
+__attribute__((target("avx2")))
+inline __m256i popcount_bytes_avx2(__m256i v) {
+  const __m256i lookup = _mm256_setr_epi8(
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+  );
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  const __m256i lo = _mm256_and_si256(v, low_mask);
+  const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+  return _mm256_add_epi8(
+    _mm256_shuffle_epi8(lookup, lo),
+    _mm256_shuffle_epi8(lookup, hi)
+  );
+}
+
+__attribute__((target("avx2")))
+inline int reduce_bytes_avx2(__m256i byte_counts) {
+  const __m256i sums = _mm256_sad_epu8(byte_counts, _mm256_setzero_si256());
+  return static_cast<int>(
+    _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+    _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3)
+  );
+}
+
+// Words of the last, partial vector of a fingerprint whose length isn't a
+// multiple of 256 bits are loaded under a mask, the other lanes read as zero
+template <size_t n>
+__attribute__((target("avx2")))
+inline __m256i load_partial_avx2(const std::uint64_t* p) {
+  const __m256i mask = _mm256_setr_epi64x(
+    n > 0 ? -1 : 0, n > 1 ? -1 : 0, n > 2 ? -1 : 0, 0
+  );
+  return _mm256_maskload_epi64(reinterpret_cast<const long long*>(p), mask);
+}
+
+// A fingerprint of up to 4096 bits is at most 16 vectors, so byte counters
+// reach at most 128 and can't overflow before the final reduction
+template <BitOp op, size_t W>
+__attribute__((target("avx2")))
+int count_op_avx2(const Words<W>& f1, const Words<W>& f2) {
+  static_assert(W <= 64, "AVX2 byte counters overflow for fingerprints over 4096 bits");
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= W; i += 4) {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&f1[i]));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&f2[i]));
+    acc = _mm256_add_epi8(acc, popcount_bytes_avx2(combine_avx2<op>(a, b)));
+  }
+  if (W % 4 != 0) {
+    const __m256i a = load_partial_avx2<W % 4>(&f1[i]);
+    const __m256i b = load_partial_avx2<W % 4>(&f2[i]);
+    acc = _mm256_add_epi8(acc, popcount_bytes_avx2(combine_avx2<op>(a, b)));
+  }
+  return reduce_bytes_avx2(acc);
+}
+
+template <size_t W>
+__attribute__((target("avx2")))
+int count_avx2(const Words<W>& fp) {
+  return count_op_avx2<BIT_AND, W>(fp, fp);
+}
+
+template <size_t W>
+__attribute__((target("avx2"), flatten))
+void count_and_block_avx2(
+    const Words<W>* const* queries, size_t n_queries,
+    const Words<W>* const* fps, size_t n_fps, int* out
+) {
+  count_and_block_loop<W, count_op_avx2<BIT_AND, W>>(queries, n_queries, fps, n_fps, out);
+}
+
+template <size_t W>
+const PopcountKernels<W> avx2_kernels = {
+  "avx2",
+  count_avx2<W>,
+  count_op_avx2<BIT_AND, W>,
+  count_op_avx2<BIT_OR, W>,
+  count_and_block_avx2<W>
+};
+
+// AVX-512 VPOPCNTDQ counts bits of eight 64-bit lanes in one instruction
+template <BitOp op>
+__attribute__((target("avx512f,avx512vpopcntdq")))
+inline __m512i combine_avx512(__m512i a, __m512i b) {
+  return op == BIT_AND ? _mm512_and_si512(a, b) : _mm512_or_si512(a, b);
+}
+
+// Sum of the eight 64-bit lanes. GCC implements _mm512_reduce_add_epi64 and
+// the 256 bit extracts with undefined vectors, which -Wall reports as
+// uninitialized, so the lanes are stored and added instead.
+__attribute__((target("avx512f")))
+inline int reduce_epi64_avx512(__m512i v) {
+  alignas(64) std::uint64_t lanes[8];
+  _mm512_store_si512(lanes, v);
+  std::uint64_t sum = 0;
+  for (auto x: lanes)
+    sum += x;
+  return static_cast<int>(sum);
+}
+
+template <BitOp op, size_t W>
+__attribute__((target("avx512f,avx512vpopcntdq")))
+int count_op_avx512(const Words<W>& f1, const Words<W>& f2) {
+  __m512i acc = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 8 <= W; i += 8) {
+    const __m512i a = _mm512_loadu_si512(&f1[i]);
+    const __m512i b = _mm512_loadu_si512(&f2[i]);
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(combine_avx512<op>(a, b)));
+  }
+  if (W % 8 != 0) {
+    const __mmask8 mask = (1 << (W % 8)) - 1;
+    const __m512i a = _mm512_maskz_loadu_epi64(mask, &f1[i]);
+    const __m512i b = _mm512_maskz_loadu_epi64(mask, &f2[i]);
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(combine_avx512<op>(a, b)));
+  }
+  return reduce_epi64_avx512(acc);
+}
+
+template <size_t W>
+__attribute__((target("avx512f,avx512vpopcntdq")))
+int count_avx512(const Words<W>& fp) {
+  return count_op_avx512<BIT_AND, W>(fp, fp);
+}
+
+template <size_t W>
+__attribute__((target("avx512f,avx512vpopcntdq"), flatten))
+void count_and_block_avx512(
+    const Words<W>* const* queries, size_t n_queries,
+    const Words<W>* const* fps, size_t n_fps, int* out
+) {
+  count_and_block_loop<W, count_op_avx512<BIT_AND, W>>(queries, n_queries, fps, n_fps, out);
+}
+
+template <size_t W>
+const PopcountKernels<W> avx512_kernels = {
+  "avx512_vpopcntdq",
+  count_avx512<W>,
+  count_op_avx512<BIT_AND, W>,
+  count_op_avx512<BIT_OR, W>,
+  count_and_block_avx512<W>
+};
+
+// Planes of 512 bits are two AVX2 vectors
+__attribute__((target("avx2")))
+void add_planes_avx2(
+    const std::uint64_t* planes, const std::uint32_t* bits, size_t n_planes,
+    std::uint64_t* counters, int depth
+) {
+  for (size_t i = 0; i < n_planes; i++) {
+    const __m256i* plane = reinterpret_cast<const __m256i*>(planes + bits[i] * plane_words);
+    __m256i carry_0 = _mm256_loadu_si256(plane);
+    __m256i carry_1 = _mm256_loadu_si256(plane + 1);
+    for (int d = 0; d < depth; d++) {
+      __m256i* c = reinterpret_cast<__m256i*>(counters + d * plane_words);
+      const __m256i c_0 = _mm256_loadu_si256(c), c_1 = _mm256_loadu_si256(c + 1);
+      _mm256_storeu_si256(c, _mm256_xor_si256(c_0, carry_0));
+      _mm256_storeu_si256(c + 1, _mm256_xor_si256(c_1, carry_1));
+      carry_0 = _mm256_and_si256(c_0, carry_0);
+      carry_1 = _mm256_and_si256(c_1, carry_1);
+      const __m256i any = _mm256_or_si256(carry_0, carry_1);
+      if (_mm256_testz_si256(any, any))
+        break;
+    }
+  }
+}
+
+const BitSliceKernels avx2_bitslice_kernels = {
+  "avx2",
+  add_planes_avx2
+};
+
+// and a single AVX-512 vector
+__attribute__((target("avx512f")))
+void add_planes_avx512(
+    const std::uint64_t* planes, const std::uint32_t* bits, size_t n_planes,
+    std::uint64_t* counters, int depth
+) {
+  for (size_t i = 0; i < n_planes; i++) {
+    __m512i carry = _mm512_loadu_si512(planes + bits[i] * plane_words);
+    for (int d = 0; d < depth; d++) {
+      std::uint64_t* c = counters + d * plane_words;
+      const __m512i c_d = _mm512_loadu_si512(c);
+      _mm512_storeu_si512(c, _mm512_xor_si512(c_d, carry));
+      carry = _mm512_and_si512(c_d, carry);
+      if (_mm512_test_epi64_mask(carry, carry) == 0)
+        break;
+    }
+  }
+}
+
+const BitSliceKernels avx512_bitslice_kernels = {
+  "avx512",
+  add_planes_avx512
+};
+
+#endif
+
+enum InstructionSet { ISA_GENERIC, ISA_POPCNT, ISA_AVX2, ISA_AVX512 };
+
+InstructionSet select_instruction_set() {
+#if MORGANCPP_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+    return ISA_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return ISA_AVX2;
+  if (__builtin_cpu_supports("popcnt"))
+    return ISA_POPCNT;
+#endif
+  return ISA_GENERIC;
+}
+
+// Selected once when the shared library is loaded
+const InstructionSet active_instruction_set = select_instruction_set();
+
+}
+
+template <size_t W>
+const PopcountKernels<W>& popcount_kernels() {
+  switch (active_instruction_set) {
+#if MORGANCPP_X86
+  case ISA_AVX512:
+    return avx512_kernels<W>;
+  case ISA_AVX2:
+    return avx2_kernels<W>;
+  case ISA_POPCNT:
+    return popcnt_kernels<W>;
+#endif
+  default:
+    return generic_kernels<W>;
+  }
+}
+
+const BitSliceKernels& bitslice_kernels() {
+  switch (active_instruction_set) {
+#if MORGANCPP_X86
+  case ISA_AVX512:
+    return avx512_bitslice_kernels;
+  case ISA_AVX2:
+    return avx2_bitslice_kernels;
+#endif
+  default:
+    return generic_bitslice_kernels;
+  }
+}
+
+// Lengths of all fingerprint collections: MACCS keys (167 bits) and
+// Morgan fingerprints of 1024, 2048 and 4096 bits, and of the 128 and 256
+// bit folded summaries used as prefilter
+template const PopcountKernels<2>& popcount_kernels<2>();
+template const PopcountKernels<3>& popcount_kernels<3>();
+template const PopcountKernels<4>& popcount_kernels<4>();
+template const PopcountKernels<16>& popcount_kernels<16>();
+template const PopcountKernels<32>& popcount_kernels<32>();
+template const PopcountKernels<64>& popcount_kernels<64>();
+
+//' Popcount kernel in use
+//'
+//' Reports which instruction set the similarity kernels were selected for.
+//' The fastest kernel supported by the CPU is picked when the package is loaded.
+//'
+//' @return One of "avx512_vpopcntdq", "avx2", "popcnt" or "generic"
+//' @export
+// [[Rcpp::export]]
+std::string popcount_kernel() {
+  return popcount_kernels<32>().name;
+}
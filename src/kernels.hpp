@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+#ifndef MORGANCPP_KERNELS_H
+#define MORGANCPP_KERNELS_H
+
+
+// Popcount kernels for one instruction set and fingerprints of W 64 bit words.
+// The best set supported by the CPU is selected once when the library is
+// loaded. Kernels are instantiated in kernels.cpp for the lengths of all
+// fingerprint collections, so their loops are fully unrolled for each length.
+template <size_t W>
+struct PopcountKernels {
+  using Words = std::array<std::uint64_t, W>;
+  const char* name;
+  int (*count)(const Words& fp);
+  int (*count_and)(const Words& f1, const Words& f2);
+  int (*count_or)(const Words& f1, const Words& f2);
+  // Intersection counts of n_queries queries against n_fps fingerprints,
+  // written to out[i * n_fps + j]
+  void (*count_and_block)(
+    const Words* const* queries, size_t n_queries,
+    const Words* const* fps, size_t n_fps, int* out
+  );
+};
+
+template <size_t W>
+const PopcountKernels<W>& popcount_kernels();
+
+// Kernels for fingerprints stored as bit planes (see bitslice.hpp). A group
+// of 512 fingerprints has one plane of 8 words for every bit, bit k of the
+// plane is set if fingerprint k of the group has the bit.
+struct BitSliceKernels {
+  const char* name;
+  // Add the planes of the given bits of a group to vertical counters, where
+  // counters[d * 8 + w] holds bit d of the counts of fingerprints 64 * w to
+  // 64 * w + 63. Counts must stay below 2^depth.
+  void (*add_planes)(
+    const std::uint64_t* planes, const std::uint32_t* bits, size_t n_planes,
+    std::uint64_t* counters, int depth
+  );
+};
+
+const BitSliceKernels& bitslice_kernels();
+
+// Kernels for the given fingerprint type
+template <typename Fp>
+const PopcountKernels<std::tuple_size<Fp>::value>& popcount_kernels_for() {
+  return popcount_kernels<std::tuple_size<Fp>::value>();
+}
+
+// Intersection counts of every query against every fingerprint, passed to
+// f(i, j, count) for query i and fingerprint j one tile at a time. A block of
+// 512 fingerprints (128kB at 2048 bits) stays in L2 cache while blocks of 32
+// queries (8kB) are compared against it from L1, so the fingerprints are
+// streamed from memory only once no matter how many queries there are.
+template <typename Fp, typename F>
+void blocked_count_and(
+    const std::vector<const Fp*>& queries,
+    const std::vector<const Fp*>& fps, F f
+) {
+  const size_t query_block = 32, fp_block = 512;
+  const auto count_and_block = popcount_kernels_for<Fp>().count_and_block;
+  std::vector<int> counts(query_block * fp_block);
+  for (size_t j0 = 0; j0 < fps.size(); j0 += fp_block) {
+    const size_t nj = std::min(fp_block, fps.size() - j0);
+    for (size_t i0 = 0; i0 < queries.size(); i0 += query_block) {
+      const size_t ni = std::min(query_block, queries.size() - i0);
+      count_and_block(&queries[i0], ni, &fps[j0], nj, counts.data());
+      for (size_t i = 0; i < ni; i++)
+        for (size_t j = 0; j < nj; j++)
+          f(i0 + i, j0 + j, counts[i * nj + j]);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,95 @@
+#include <Rcpp.h>
+#include "zstd/zstd.h"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+#include "lsh.hpp"
+
+using namespace Rcpp;
+
+namespace {
+
+const char lsh_file_magic[] = "MORGANLSH";
+const std::uint32_t lsh_file_version = 1;
+
+}
+
+void MinHashIndex::init_hashes() {
+  hashes.resize(static_cast<size_t>(bands) * rows * n_bits);
+  for (size_t k = 0; k < hashes.size(); k++)
+    hashes[k] = mix64(seed ^ mix64(k)) >> 32;
+}
+
+void MinHashIndex::save(const std::string& path, int compression_level) const {
+  if (compression_level < 1 || compression_level > 22)
+    stop("Compression level must be between 0 and 22. Default = 3");
+  std::ofstream out_stream;
+  out_stream.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out_stream)
+    stop("Can't open %s for writing", path);
+  const std::uint32_t length = n_bits;
+  const std::uint64_t n_fps = n;
+  const std::uint32_t n_bands = bands, n_rows = rows;
+  out_stream.write(lsh_file_magic, 9);
+  out_stream.write(reinterpret_cast<const char*>(&lsh_file_version), sizeof(lsh_file_version));
+  out_stream.write(reinterpret_cast<const char*>(&length), sizeof(length));
+  out_stream.write(reinterpret_cast<const char*>(&n_fps), sizeof(n_fps));
+  out_stream.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+  out_stream.write(reinterpret_cast<const char*>(&n_bands), sizeof(n_bands));
+  out_stream.write(reinterpret_cast<const char*>(&n_rows), sizeof(n_rows));
+  out_stream.write(reinterpret_cast<const char*>(&seed), sizeof(seed));
+  for (int b = 0; b < bands; b++) {
+    zstd_write_block(out_stream, reinterpret_cast<const char*>(keys[b].data()), n * sizeof(std::uint32_t), compression_level);
+    zstd_write_block(out_stream, reinterpret_cast<const char*>(ids[b].data()), n * sizeof(std::uint32_t), compression_level);
+  }
+  out_stream.close();
+  if (out_stream.fail())
+    stop("Error writing index file %s", path);
+}
+
+void MinHashIndex::load(const std::string& path) {
+  std::ifstream in_stream;
+  in_stream.open(path, std::ios::in | std::ios::binary);
+  if (!in_stream)
+    stop("Can't open %s", path);
+  char magic[] = "xORGANLSH";
+  in_stream.read(magic, 9);
+  if (strcmp(magic, lsh_file_magic) != 0)
+    stop("File is incompatible, doesn't start with 'MORGANLSH': '%s'", magic);
+  std::uint32_t version, length, n_bands, n_rows;
+  std::uint64_t n_fps;
+  in_stream.read(reinterpret_cast<char*>(&version), sizeof(version));
+  if (version != lsh_file_version)
+    stop("Unsupported index file version %i", version);
+  in_stream.read(reinterpret_cast<char*>(&length), sizeof(length));
+  in_stream.read(reinterpret_cast<char*>(&n_fps), sizeof(n_fps));
+  in_stream.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+  in_stream.read(reinterpret_cast<char*>(&n_bands), sizeof(n_bands));
+  in_stream.read(reinterpret_cast<char*>(&n_rows), sizeof(n_rows));
+  in_stream.read(reinterpret_cast<char*>(&seed), sizeof(seed));
+  if (!in_stream)
+    stop("Index file %s is truncated", path);
+  // The parameters size the hash functions and bands, so they are checked
+  // against the limits of build_lsh() before allocating them
+  if (n_bands < 1 || n_rows < 1 || n_bands * static_cast<std::uint64_t>(n_rows) > 1024 ||
+      length == 0 || length > 4096 || length % 64 != 0 || n_fps > UINT32_MAX)
+    stop("Index file %s is inconsistent", path);
+  bands = n_bands;
+  rows = n_rows;
+  n_bits = length;
+  n = n_fps;
+  init_hashes();
+  keys.assign(bands, std::vector<std::uint32_t>(n));
+  ids.assign(bands, std::vector<std::uint32_t>(n));
+  for (int b = 0; b < bands; b++) {
+    zstd_read_block(in_stream, reinterpret_cast<char*>(keys[b].data()), n * sizeof(std::uint32_t));
+    zstd_read_block(in_stream, reinterpret_cast<char*>(ids[b].data()), n * sizeof(std::uint32_t));
+    for (auto i: ids[b]) {
+      if (i >= n)
+        stop("Index file %s is inconsistent", path);
+    }
+  }
+}
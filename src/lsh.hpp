@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parallel.hpp"
+#include "utils.hpp"
+
+#ifndef MORGANCPP_LSH_H
+#define MORGANCPP_LSH_H
+
+
+// Approximate similarity index using banded MinHash over the bits set in
+// each fingerprint (Broder 1997, Indyk & Motwani 1998).
+//
+// Each of bands * rows hash functions maps every bit to a random 32 bit value,
+// and the MinHash of a fingerprint is the smallest value over its set bits.
+// Two fingerprints get the same MinHash with probability equal to their
+// Jaccard similarity s. The MinHashes of each band of rows hash functions are
+// combined into one key, so two fingerprints share a key in at least one band
+// with probability 1 - (1 - s^rows)^bands. More rows make the index more
+// selective, more bands raise the recall.
+//
+// The positions of the fingerprints are stored sorted by key separately for
+// every band, which takes 8 bytes per band for every fingerprint.
+class MinHashIndex {
+
+public:
+
+  int bands = 0;
+  int rows = 0;
+  std::uint64_t seed = 0;
+  // Bits per fingerprint and number of fingerprints the index was built for
+  size_t n_bits = 0;
+  size_t n = 0;
+  // Hash of all fingerprints, to check that a loaded index belongs to them
+  std::uint64_t checksum = 0;
+  // Keys of every band in increasing order and the positions of the
+  // fingerprints they belong to
+  std::vector<std::vector<std::uint32_t>> keys;
+  std::vector<std::vector<std::uint32_t>> ids;
+
+  bool empty() const {
+    return bands == 0;
+  }
+
+  size_t size() const {
+    size_t bytes = 0;
+    for (int b = 0; b < bands; b++)
+      bytes += (keys[b].size() + ids[b].size()) * sizeof(std::uint32_t);
+    return bytes;
+  }
+
+  template <typename Fps>
+  void build(const Fps& fps, int bands_, int rows_, std::uint64_t seed_, int n_threads) {
+    using Fp = typename Fps::value_type;
+    bands = bands_;
+    rows = rows_;
+    seed = seed_;
+    n_bits = sizeof(Fp) * 8;
+    n = fps.size();
+    checksum = fingerprints_checksum(fps);
+    init_hashes();
+    keys.assign(bands, std::vector<std::uint32_t>(n));
+    ids.assign(bands, std::vector<std::uint32_t>(n));
+    const size_t chunk_size = 4096;
+    parallel_for((n + chunk_size - 1) / chunk_size, n_threads, [&](size_t chunk, int worker) {
+      std::vector<std::uint32_t> fp_keys(bands);
+      const size_t end = std::min(n, (chunk + 1) * chunk_size);
+      for (size_t i = chunk * chunk_size; i < end; i++) {
+        band_keys(fps[i], fp_keys);
+        for (int b = 0; b < bands; b++)
+          keys[b][i] = fp_keys[b];
+      }
+    });
+    // Order every band by key, and by position for equal keys
+    parallel_for(bands, n_threads, [&](size_t b, int worker) {
+      std::vector<std::uint64_t> entries(n);
+      for (size_t i = 0; i < n; i++)
+        entries[i] = static_cast<std::uint64_t>(keys[b][i]) << 32 | i;
+      std::sort(entries.begin(), entries.end());
+      for (size_t i = 0; i < n; i++) {
+        keys[b][i] = entries[i] >> 32;
+        ids[b][i] = entries[i] & 0xffffffff;
+      }
+    });
+  }
+
+  // Positions of all fingerprints sharing a key with fp in at least one band,
+  // in increasing order
+  template <typename Fp>
+  std::vector<std::uint32_t> candidates(const Fp& fp) const {
+    std::vector<std::uint32_t> fp_keys(bands);
+    band_keys(fp, fp_keys);
+    std::vector<std::uint32_t> out;
+    for (int b = 0; b < bands; b++) {
+      auto range = std::equal_range(keys[b].begin(), keys[b].end(), fp_keys[b]);
+      out.insert(
+        out.end(), ids[b].begin() + (range.first - keys[b].begin()),
+        ids[b].begin() + (range.second - keys[b].begin())
+      );
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+  }
+
+  // Index files start with "MORGANLSH", a format version, the fingerprint
+  // length and number, and the parameters of the hash functions, followed by
+  // the keys and positions of every band as zstd frames
+  void save(const std::string& path, int compression_level) const;
+  void load(const std::string& path);
+
+private:
+
+  // Hash value of every bit for every hash function, bits of hash
+  // function k at hashes[k * n_bits:(k + 1) * n_bits]
+  std::vector<std::uint32_t> hashes;
+
+  void init_hashes();
+
+  template <typename Fp>
+  void band_keys(const Fp& fp, std::vector<std::uint32_t>& out) const {
+    for (int b = 0; b < bands; b++) {
+      std::uint64_t key = 0;
+      for (int r = 0; r < rows; r++) {
+        const std::uint32_t* h = &hashes[(b * rows + r) * n_bits];
+        std::uint32_t min_hash = UINT32_MAX;
+        for (size_t w = 0; w < fp.size(); w++) {
+          for (std::uint64_t x = fp[w]; x != 0; x &= x - 1)
+            min_hash = std::min(min_hash, h[w * 64 + __builtin_ctzll(x)]);
+        }
+        key = mix64(key ^ min_hash);
+      }
+      out[b] = static_cast<std::uint32_t>(key >> 32);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,266 @@
+#include <Rcpp.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MORGANCPP_MMAP 1
+#else
+#define MORGANCPP_MMAP 0
+#endif
+
+#include "memory.hpp"
+
+using namespace Rcpp;
+
+namespace {
+
+const size_t line_size = 64;
+
+HugePages default_mode = HugePages::none;
+
+size_t base_page_size() {
+#if defined(__unix__) || defined(__APPLE__)
+  return sysconf(_SC_PAGESIZE);
+#else
+  return 4096;
+#endif
+}
+
+#ifdef __linux__
+
+// First number on the line of a /proc or /sys file starting with key
+size_t read_number(const char* path, const std::string& key) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, key.size(), key) == 0) {
+      std::istringstream fields(line.substr(key.size()));
+      size_t value = 0;
+      fields >> value;
+      return value;
+    }
+  }
+  return 0;
+}
+
+size_t transparent_page_size() {
+  static const size_t size = [] {
+    const size_t s = read_number("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "");
+    return s > 0 ? s : size_t(2) << 20;
+  }();
+  return size;
+}
+
+size_t hugetlb_page_size() {
+  static const size_t size = [] {
+    const size_t s = read_number("/proc/meminfo", "Hugepagesize:") * 1024;
+    return s > 0 ? s : size_t(2) << 20;
+  }();
+  return size;
+}
+
+size_t huge_page_size(HugePages mode) {
+  return mode == HugePages::hugetlb ? hugetlb_page_size() : transparent_page_size();
+}
+
+bool mapped(size_t bytes, HugePages mode) {
+  return mode != HugePages::none && bytes >= huge_page_size(mode);
+}
+
+size_t mapped_size(size_t bytes, HugePages mode) {
+  const size_t page = huge_page_size(mode);
+  return (bytes + page - 1) / page * page;
+}
+
+// Anonymous mapping of size bytes aligned to a transparent huge page, cut
+// out of a larger mapping
+void* map_transparent(size_t size) {
+  const size_t align = transparent_page_size();
+  void* raw = mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    throw std::bad_alloc();
+  const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(raw);
+  const std::uintptr_t aligned = (start + align - 1) / align * align;
+  if (aligned > start)
+    munmap(raw, aligned - start);
+  if (start + align > aligned)
+    munmap(reinterpret_cast<void*>(aligned + size), start + align - aligned);
+  void* p = reinterpret_cast<void*>(aligned);
+  madvise(p, size, MADV_HUGEPAGE);
+  return p;
+}
+
+#endif
+
+}
+
+HugePages parse_huge_pages(const std::string& mode) {
+  if (mode == "none")
+    return HugePages::none;
+  if (mode == "transparent")
+    return HugePages::transparent;
+  if (mode == "explicit")
+    return HugePages::hugetlb;
+  stop("Huge pages must be 'none', 'transparent' or 'explicit'");
+}
+
+std::string huge_pages_name(HugePages mode) {
+  switch (mode) {
+  case HugePages::transparent:
+    return "transparent";
+  case HugePages::hugetlb:
+    return "explicit";
+  default:
+    return "none";
+  }
+}
+
+HugePages default_huge_pages() {
+  return default_mode;
+}
+
+void* allocate_storage(size_t bytes, HugePages mode) {
+#ifdef __linux__
+  if (mapped(bytes, mode)) {
+    const size_t size = mapped_size(bytes, mode);
+    if (mode == HugePages::hugetlb) {
+      void* p = mmap(
+        nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+      );
+      if (p != MAP_FAILED)
+        return p;
+    }
+    return map_transparent(size);
+  }
+#endif
+  // The pointer returned by malloc is kept just before the aligned block
+  void* raw = std::malloc(bytes + line_size + sizeof(void*));
+  if (raw == nullptr)
+    throw std::bad_alloc();
+  const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*);
+  void** p = reinterpret_cast<void**>((start + line_size - 1) / line_size * line_size);
+  p[-1] = raw;
+  return p;
+}
+
+void free_storage(void* p, size_t bytes, HugePages mode) {
+  if (p == nullptr)
+    return;
+#ifdef __linux__
+  if (mapped(bytes, mode)) {
+    munmap(p, mapped_size(bytes, mode));
+    return;
+  }
+#endif
+  std::free(static_cast<void**>(p)[-1]);
+}
+
+size_t page_size_at(const void* p) {
+#ifdef __linux__
+  if (p == nullptr)
+    return base_page_size();
+  // The mapping holding p lists the size of its pages and how much of it
+  // the kernel backed with transparent huge pages
+  std::ifstream smaps("/proc/self/smaps");
+  const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(p);
+  std::string line;
+  bool found = false;
+  size_t page_size = 0;
+  while (std::getline(smaps, line)) {
+    std::uintptr_t begin, end;
+    char dash;
+    std::istringstream range(line);
+    if (range >> std::hex >> begin >> dash >> end && dash == '-') {
+      if (found)
+        break;
+      found = begin <= address && address < end;
+      continue;
+    }
+    if (!found)
+      continue;
+    std::istringstream field(line);
+    std::string key;
+    size_t kb = 0;
+    field >> key >> kb;
+    if (key == "KernelPageSize:")
+      page_size = kb * 1024;
+    else if (key == "AnonHugePages:" && kb > 0)
+      page_size = std::max(page_size, transparent_page_size());
+  }
+  if (page_size > 0)
+    return page_size;
+#endif
+  return base_page_size();
+}
+
+MappedFile::MappedFile(const std::string& path) {
+#if MORGANCPP_MMAP
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    stop("Can't open %s", path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    stop("Can't read size of %s", path);
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      stop("Can't map %s into memory", path);
+    }
+    data_ = static_cast<const char*>(p);
+  }
+  // The mapping stays valid after the file is closed
+  close(fd);
+#else
+  std::ifstream in(path, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!in)
+    stop("Can't open %s", path);
+  copy.resize(in.tellg());
+  in.seekg(0);
+  in.read(copy.data(), copy.size());
+  data_ = copy.data();
+  size_ = copy.size();
+#endif
+}
+
+MappedFile::~MappedFile() {
+#if MORGANCPP_MMAP
+  if (size_ > 0)
+    munmap(const_cast<char*>(data_), size_);
+#endif
+}
+
+//' Huge pages for fingerprint collections
+//'
+//' Sets whether fingerprint collections created from now on store their
+//' fingerprints on huge pages, which makes scans over large collections
+//' miss the TLB less often. Huge pages are only supported on Linux, other
+//' systems ignore the setting. Fingerprints are always aligned to 64 byte
+//' cache lines. Use the `page_size()` field of a collection to check the
+//' page size it got.
+//'
+//' @param mode "none" for regular pages, "transparent" for transparent huge
+//'   pages, which the kernel provides if it can, or "explicit" for huge
+//'   pages reserved by the administrator, e.g. via `vm.nr_hugepages`,
+//'   falling back to transparent ones if none are free
+//' @return The previous mode
+//' @export
+// [[Rcpp::export]]
+std::string huge_pages(const std::string& mode) {
+  const HugePages previous = default_mode;
+  default_mode = parse_huge_pages(mode);
+  return huge_pages_name(previous);
+}
@@ -0,0 +1,195 @@
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef MORGANCPP_MEMORY_H
+#define MORGANCPP_MEMORY_H
+
+
+// Storage for fingerprint collections. Every block starts on a 64 byte cache
+// line, so 2048 bit and longer fingerprints never straddle lines. Large
+// blocks can be backed by huge pages, which saves TLB misses in scans over
+// collections of many gigabytes:
+//
+// - transparent: a 2 MB aligned anonymous mapping advised with
+//   MADV_HUGEPAGE, which the kernel backs with huge pages if it can
+// - hugetlb: a MAP_HUGETLB mapping from the reserved pool of explicit huge
+//   pages, falling back to transparent ones if the pool is empty
+//
+// Huge pages are only used on Linux and for blocks of at least one huge page,
+// everywhere else blocks come from malloc. How a block was allocated only
+// depends on its size and mode, so it's freed the same way.
+enum class HugePages { none, transparent, hugetlb };
+
+HugePages parse_huge_pages(const std::string& mode);
+std::string huge_pages_name(HugePages mode);
+
+// Mode of collections created from now on, set by huge_pages()
+HugePages default_huge_pages();
+
+void* allocate_storage(size_t bytes, HugePages mode);
+void free_storage(void* p, size_t bytes, HugePages mode);
+
+// Size of the pages backing the memory at p, which may differ from the mode
+// it was allocated with if the kernel couldn't provide huge pages
+size_t page_size_at(const void* p);
+
+template <typename T>
+class AlignedAllocator {
+
+public:
+
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  HugePages huge_pages;
+
+  AlignedAllocator() : huge_pages(default_huge_pages()) {}
+
+  explicit AlignedAllocator(HugePages huge_pages_) : huge_pages(huge_pages_) {}
+
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U>& other) : huge_pages(other.huge_pages) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(allocate_storage(n * sizeof(T), huge_pages));
+  }
+
+  void deallocate(T* p, size_t n) {
+    free_storage(p, n * sizeof(T), huge_pages);
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U>& other) const {
+    return huge_pages == other.huge_pages;
+  }
+
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U>& other) const {
+    return huge_pages != other.huge_pages;
+  }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// Read-only mapping of a whole file, shared with other processes mapping the
+// same file through the page cache. Systems without mmap read the file into
+// memory instead.
+class MappedFile {
+
+public:
+
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+private:
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  std::vector<char> copy;
+};
+
+// Array that either owns aligned memory or refers to a section of a mapped
+// file, which stays mapped as long as any array refers to it. Mapped arrays
+// are read-only, resizing one turns it into an owned copy.
+template <typename T>
+class Storage {
+
+public:
+
+  using value_type = T;
+  using iterator = const T*;
+  using const_iterator = const T*;
+
+  size_t size() const {
+    return file ? mapped_size : owned.size();
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  bool mapped() const {
+    return static_cast<bool>(file);
+  }
+
+  const T* data() const {
+    return file ? mapped_data : owned.data();
+  }
+
+  // Writable data of an owned array
+  T* mutable_data() {
+    unmap();
+    return owned.data();
+  }
+
+  const T& operator[](size_t i) const {
+    return data()[i];
+  }
+
+  const T* begin() const {
+    return data();
+  }
+
+  const T* end() const {
+    return data() + size();
+  }
+
+  void resize(size_t n) {
+    unmap();
+    owned.resize(n);
+  }
+
+  void reserve(size_t n) {
+    unmap();
+    owned.reserve(n);
+  }
+
+  void push_back(const T& x) {
+    unmap();
+    owned.push_back(x);
+  }
+
+  // Refer to n elements at the given byte offset of a mapped file, which
+  // must be aligned for T
+  void map(std::shared_ptr<const MappedFile> file_, size_t offset, size_t n) {
+    owned.clear();
+    owned.shrink_to_fit();
+    file = std::move(file_);
+    mapped_data = reinterpret_cast<const T*>(file->data() + offset);
+    mapped_size = n;
+  }
+
+private:
+
+  AlignedVector<T> owned;
+  std::shared_ptr<const MappedFile> file;
+  const T* mapped_data = nullptr;
+  size_t mapped_size = 0;
+
+  void unmap() {
+    if (!file)
+      return;
+    owned.assign(mapped_data, mapped_data + mapped_size);
+    file.reset();
+    mapped_data = nullptr;
+    mapped_size = 0;
+  }
+};
+
+#endif
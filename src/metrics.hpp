@@ -0,0 +1,132 @@
+#include <Rcpp.h>
+#include <cmath>
+#include <limits>
+#include <string>
+
+#ifndef MORGANCPP_METRICS_H
+#define MORGANCPP_METRICS_H
+
+
+// Similarity metrics computed from the number of bits c shared by a query and
+// a target fingerprint and the number of bits a and b set in each of them.
+//
+// Every metric is monotonic in c for fixed a and b, so its best possible value
+// for two popcounts is reached at c = min(a, b). Searches use this to skip
+// fingerprints by popcount alone. Scores are compared through rank(), which is
+// larger for more similar pairs, so that distances can be handled the same way.
+
+struct Tanimoto {
+  static constexpr bool is_distance = false;
+  double operator()(int c, int a, int b) const {
+    return static_cast<double>(c) / (a + b - c);
+  }
+  bool symmetric() const { return true; }
+};
+
+struct Dice {
+  static constexpr bool is_distance = false;
+  double operator()(int c, int a, int b) const {
+    return 2.0 * c / (a + b);
+  }
+  bool symmetric() const { return true; }
+};
+
+struct Cosine {
+  static constexpr bool is_distance = false;
+  double operator()(int c, int a, int b) const {
+    return c / std::sqrt(static_cast<double>(a) * b);
+  }
+  bool symmetric() const { return true; }
+};
+
+// Asymmetric unless alpha == beta. alpha weights the bits only set in the
+// query, beta those only set in the target. alpha = 1, beta = 0 gives the
+// fraction of query bits present in the target.
+struct Tversky {
+  static constexpr bool is_distance = false;
+  double alpha;
+  double beta;
+  double operator()(int c, int a, int b) const {
+    return c / (alpha * (a - c) + beta * (b - c) + c);
+  }
+  bool symmetric() const { return alpha == beta; }
+};
+
+// Number of differing bits
+struct Hamming {
+  static constexpr bool is_distance = true;
+  double operator()(int c, int a, int b) const {
+    return a + b - 2 * c;
+  }
+  bool symmetric() const { return true; }
+};
+
+template <typename Metric>
+inline double rank(double score) {
+  return Metric::is_distance ? -score : score;
+}
+
+// Largest rank any target with b bits set can reach against a query with a
+// bits set. Undefined scores (e.g. Tanimoto of two empty fingerprints) can't
+// reach any threshold and rank lowest.
+template <typename Metric>
+inline double rank_bound(const Metric& metric, int a, int b) {
+  const double r = rank<Metric>(metric(std::min(a, b), a, b));
+  return std::isnan(r) ? -std::numeric_limits<double>::infinity() : r;
+}
+
+enum class MetricKind { tanimoto, dice, cosine, tversky, hamming };
+
+struct MetricSpec {
+  MetricKind kind;
+  double alpha;
+  double beta;
+};
+
+// Parse metric name, optionally wrapped in similarity_metric() to set parameters
+inline MetricSpec parse_metric(const Rcpp::CharacterVector& metric) {
+  if (metric.length() != 1)
+    Rcpp::stop("Requires exactly one metric");
+  const std::string name = Rcpp::as<std::string>(metric(0));
+  MetricSpec spec{MetricKind::tanimoto, 1.0, 1.0};
+  if (metric.hasAttribute("alpha"))
+    spec.alpha = Rcpp::as<double>(metric.attr("alpha"));
+  if (metric.hasAttribute("beta"))
+    spec.beta = Rcpp::as<double>(metric.attr("beta"));
+  if (name == "tanimoto") {
+    spec.kind = MetricKind::tanimoto;
+  } else if (name == "dice") {
+    spec.kind = MetricKind::dice;
+  } else if (name == "cosine") {
+    spec.kind = MetricKind::cosine;
+  } else if (name == "tversky") {
+    spec.kind = MetricKind::tversky;
+    if (spec.alpha < 0 || spec.beta < 0)
+      Rcpp::stop("Tversky weights must not be negative");
+  } else if (name == "hamming") {
+    spec.kind = MetricKind::hamming;
+  } else {
+    Rcpp::stop("Unknown metric '%s'", name);
+  }
+  return spec;
+}
+
+// Call f with an instance of the metric, so that f is compiled separately for
+// every metric and the metric is fixed for the whole query
+template <typename F>
+auto with_metric(const MetricSpec& spec, F f) -> decltype(f(Tanimoto())) {
+  switch (spec.kind) {
+  case MetricKind::dice:
+    return f(Dice());
+  case MetricKind::cosine:
+    return f(Cosine());
+  case MetricKind::tversky:
+    return f(Tversky{spec.alpha, spec.beta});
+  case MetricKind::hamming:
+    return f(Hamming());
+  default:
+    return f(Tanimoto());
+  }
+}
+
+#endif
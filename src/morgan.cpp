@@ -1,57 +1,92 @@
 #include <Rcpp.h>
 #include "zstd/zstd.h"
 #include <array>
+#include <cstring>
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
 #include <string>
+#include <tuple>
 
 #include "utils.hpp"
+#include "bitslice.hpp"
+#include "chunks.hpp"
+#include "hnsw.hpp"
+#include "kernels.hpp"
+#include "lsh.hpp"
+#include "memory.hpp"
+#include "metrics.hpp"
+#include "pairfile.hpp"
+#include "pairs.hpp"
+#include "parallel.hpp"
+#include "postings.hpp"
+#include "prefilter.hpp"
+#include "sparse.hpp"
+#include "vptree.hpp"
 
 using namespace Rcpp;
 
-// Compute Jaccard similarity of two fingerprints
-double jaccard_fp(const Fingerprint& f1, const Fingerprint& f2) {
-  int count_and = 0, count_or = 0;
-  auto i1 = std::cbegin(f1), i2 = std::cbegin(f2);
-  while (i1 != std::cend(f1)) {
-    count_and += __builtin_popcountll(*i1 & *i2);
-    count_or += __builtin_popcountll(*i1 | *i2);
-    ++i1;
-    ++i2;
-  }
-  return static_cast<double>(count_and) / count_or;
+// Compute Jaccard similarity of two fingerprints using the popcount kernels
+// selected for this CPU
+template <typename Fp>
+double jaccard_fp(const Fp& f1, const Fp& f2) {
+  const auto& kernels = popcount_kernels_for<Fp>();
+  return static_cast<double>(kernels.count_and(f1, f2)) / kernels.count_or(f1, f2);
 }
 
-Fingerprint convert_fp(const CharacterVector& fps_hex) {
+template <size_t fp_length>
+FingerprintOf<fp_length> convert_fp(const CharacterVector& fps_hex) {
   if (fps_hex.length() != 1)
     stop("Requires exactly one fingerprint");
   std::string format = guess_fp_format(fps_hex);
-  auto string_to_fp = select_fp_reader(format);
+  auto string_to_fp = select_fp_reader<fp_length>(format);
   return string_to_fp(as<std::string>(fps_hex(0)));
 }
 
+template <size_t fp_length>
+double tanimoto_fp(const CharacterVector& s1, const CharacterVector& s2) {
+  return jaccard_fp(convert_fp<fp_length>(s1), convert_fp<fp_length>(s2));
+}
+
 //' Tanimoto similarity between two Morgan fingerprints
 //'
-//' Computes Tanimoto similarity between two hexadecimal strings
+//' Computes Tanimoto similarity between two hexadecimal strings. The length
+//' of the fingerprints is taken from the first one and can be any of those of
+//' the collections: 167 (MACCS keys), 1024, 2048 or 4096 bits.
 //'
-//' @param s1,s2 Two fingerprints, optionally each wrapped in [fingerprints()]
+//' @param s1,s2 Two fingerprints of the same length, optionally each wrapped
+//'   in [fingerprints()]
 //' @return Jaccard similarity over the bits representing individual keys
 //' @export
 // [[Rcpp::export]]
 double tanimoto(const CharacterVector& s1, const CharacterVector& s2) {
-  const Fingerprint& fp1 = convert_fp(s1);
-  const Fingerprint& fp2 = convert_fp(s2);
-  return jaccard_fp(fp1, fp2);
+  if (s1.length() != 1)
+    stop("Requires exactly one fingerprint");
+  switch (fp_bits(as<std::string>(s1(0)), guess_fp_format(s1))) {
+    case 167:
+    case 168:
+      return tanimoto_fp<167>(s1, s2);
+    case 1024:
+      return tanimoto_fp<1024>(s1, s2);
+    case 4096:
+      return tanimoto_fp<4096>(s1, s2);
+    default:
+      // Other lengths are reported by the 2048 bit parser
+      return tanimoto_fp<2048>(s1, s2);
+  }
 }
 
+template <size_t fp_length, typename Fps>
 void convert_fps(
     const CharacterVector& fps_hex,
     std::vector<FingerprintName>& out_names,
-    std::vector<Fingerprint>& out_fps
+    Fps& out_fps
 ) {
   std::string format = guess_fp_format(fps_hex);
-  auto string_to_fp = select_fp_reader(format);
+  auto string_to_fp = select_fp_reader<fp_length>(format);
   size_t n = fps_hex.length();
   RObject passed_names = fps_hex.names();
   out_fps.reserve(n);
@@ -79,6 +114,14 @@ void convert_fps(
 //' @name MorganFPS
 //' @title Morgan fingerprints collection
 //' @description Efficient structure for storing a set of Morgan fingerprints
+//'
+//' `MorganFPS` holds 2048 bit fingerprints. `MorganFPS1024`, `MorganFPS4096`
+//' and `MACCSFPS` (167 bit RDKit MACCS keys) provide the same fields for
+//' other fingerprint lengths. Hex strings need to encode exactly one byte
+//' for every 8 bits, e.g. 256 characters for 1024 bits and 42 characters for
+//' MACCS keys. Files record the fingerprint length and can only be loaded by
+//' the collection they were saved from.
+//' @aliases MorganFPS1024 MorganFPS4096 MACCSFPS
 //' @field new Construct new fingerprint dataset
 //'
 //' Accepts either a vector of fingerprints in hexadecimal
@@ -90,157 +133,814 @@ void convert_fps(
 //' \itemize{
 //'   \item Parameter fingerprints - Character vector of fingerprints,
 //'     optionally wrapped in [fingerprints()], or path to fingerprint file
-//'     saved using `save_file()`.
+//'     saved using `save_file()` or `save_mapped()`. Files saved with
+//'     `save_mapped()` are memory mapped and used in place, so they open
+//'     instantly and R processes using the same file share its memory.
 //'   \item Parameter: from_file (default FALSE) - Set true to load from file
+//'   \item Parameter: lazy (default FALSE) - Set true to only read the names
+//'     from a file saved by `save_file()`. Fingerprints are then read from
+//'     the file as `tanimoto()` and `tanimoto_subset()` with two sets of ids
+//'     need them, decompressing only the chunks of 65536 fingerprints
+//'     holding them, the last 8 of which are cached. Any other method reads
+//'     the whole file first.
 //' }
 //' @field tanimoto similarity between fingerprints i and j \itemize{
 //'   \item Parameters: i, j - integer labels of two fingerprints
+//'   \item Parameter: metric (default "tanimoto") - Optional similarity
+//'     metric, see [similarity_metric()]
 //'   \item Returns: scalar numeric - Tanimoto similarity
 //' }
 //' @field tanimoto_all similarity between fingerprint i and all others \itemize{
 //'   \item Parameter: i - integer label of fingerprint
+//'   \item Parameter: threshold (optional) - only return fingerprints with
+//'     similarity above this threshold. Fingerprints whose number of set bits
+//'     can't reach the threshold are skipped without comparing them.
+//'   \item Parameter: metric (default "tanimoto") - Optional similarity
+//'     metric, see [similarity_metric()]
 //'   \item Returns: Dataframe with columns "id" and "similarity"
 //' }
 //' @field tanimoto_threshold similarity of all NxN combinations of fingerprints
 //'   above the given threshold \itemize{
 //'   \item Parameter: threshold - numeric threshold between 0 and 1
-//'   \item Returns: Dataframe with columns "id_1", "id_2", and "similarity"
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Parameter: metric (default "tanimoto") - Optional symmetric
+//'     similarity metric, see [similarity_metric()]
+//'   \item Returns: Dataframe with columns "id_1", "id_2", and "similarity",
+//'     with id_1 < id_2 and sorted by id_1 and then id_2
+//' }
+//' @field tanimoto_threshold_file similarity of all NxN combinations of
+//'   fingerprints above the given threshold, written to a file as they are
+//'   found so that memory use doesn't grow with the number of pairs \itemize{
+//'   \item Parameter: threshold - numeric threshold between 0 and 1
+//'   \item Parameter: path - Path of the zstd compressed pair file, read it
+//'     with [read_pairs_file()]
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Parameter: metric (default "tanimoto") - Optional symmetric
+//'     similarity metric, see [similarity_metric()]
+//'   \item Returns: List with the path of the file and the number of pairs n.
+//'     Pairs are written in no particular order when using several threads.
+//' }
+//' @field tanimoto_threshold_sparse similarity of all NxN combinations of
+//'   fingerprints above the given threshold as sparse matrix \itemize{
+//'   \item Parameter: threshold - numeric threshold between 0 and 1
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Parameter: metric (default "tanimoto") - Optional symmetric
+//'     similarity metric, see [similarity_metric()]
+//'   \item Returns: Symmetric `Matrix::dsCMatrix` storing the upper triangle,
+//'     with rows and columns in collection order and fingerprint names as
+//'     dimnames. The diagonal is left empty. Requires the Matrix package.
+//' }
+//' @field cluster_butina Taylor-Butina clustering of all fingerprints
+//'   \itemize{
+//'   \item Parameter: threshold - fingerprints with similarity above the
+//'     threshold are neighbours
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used to find the neighbours
+//'   \item Parameter: metric (default "tanimoto") - Optional symmetric
+//'     similarity metric, see [similarity_metric()]
+//'   \item Returns: Dataframe with columns "id", "cluster", and "centroid".
+//'     Clusters are numbered from 1 in the order they were formed, starting
+//'     with the fingerprint with most neighbours.
+//' }
+//' @field pick_diverse MaxMin selection of diverse fingerprints. Each pick
+//'   is the fingerprint least similar to its most similar earlier pick
+//'   \itemize{
+//'   \item Parameter: n - number of fingerprints to pick
+//'   \item Parameter: seed - seed for choosing the first fingerprint at random
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Parameter: metric (default "tanimoto") - Optional symmetric
+//'     similarity metric, see [similarity_metric()]
+//'   \item Returns: Dataframe with columns "id" and "similarity" in the order
+//'     of picking. "similarity" is the similarity to the most similar earlier
+//'     pick, NA for the first one.
 //' }
 //' @field tanimoto_subset similarity of a set of fingerprints against another set,
 //'   or all fingerprints in the collection when j is NULL \itemize{
 //'   \item Parameters: i, j - vectors of fingerprint labels. j can be NULL.
+//'   \item Parameter: metric (default "tanimoto") - Optional similarity
+//'     metric, see [similarity_metric()]
 //'   \item Returns: Dataframe with columns "id_1", "id_2", and "similarity"
 //' }
+//' @field tanimoto_subset_sparse similarity of a set of fingerprints against
+//'   another set above the given threshold as sparse matrix \itemize{
+//'   \item Parameters: i, j - vectors of fingerprint labels. j can be NULL
+//'     to compare against all fingerprints in the collection.
+//'   \item Parameter: threshold - only store similarities above this threshold
+//'   \item Parameter: metric (default "tanimoto") - Optional similarity
+//'     metric, see [similarity_metric()]
+//'   \item Returns: `Matrix::dgCMatrix` with a row for every fingerprint in i
+//'     and a column for every fingerprint in j, both ordered by name and
+//'     named by them. Requires the Matrix package.
+//' }
+//' @field tanimoto_matrix similarity of all pairs of the given fingerprints.
+//'   Only the upper triangle is computed, in parallel \itemize{
+//'   \item Parameter: ids - vector of fingerprint labels, or NULL for all
+//'     fingerprints in the collection. Fingerprints are ordered by label.
+//'   \item Parameter: format (default "matrix") - "matrix" for a symmetric
+//'     numeric matrix, "dist" for a `dist` object of 1 - similarity, or
+//'     "packed" for the upper triangle packed by rows
+//'   \item Parameter: precision (default "double") - Storage of packed output.
+//'     "double" returns a numeric vector, "float" and "uint16" a raw vector of
+//'     float32 or of similarities scaled to 0-65535 that can be read using
+//'     `readBin(x, "numeric", size = 4, n = length(x) / 4)` or
+//'     `readBin(x, "integer", size = 2, signed = FALSE, n = length(x) / 2)`
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the computation
+//'   \item Parameter: metric (default "tanimoto") - Optional symmetric
+//'     similarity metric, see [similarity_metric()]
+//'   \item Returns: Matrix with labels as dimnames, or dist or packed vector
+//'     with attributes "Size" and "Labels"
+//' }
 //' @field tanimoto_ext similarity between given fingerprint and all
 //'   fingerprints in the collection \itemize{
 //'   \item Parameter: s - Fingerprint, optionally wrapped in [fingerprints()]
 //'     to specify encoding
+//'   \item Parameter: threshold (optional) - only return fingerprints with
+//'     similarity above this threshold
+//'   \item Parameter: metric (default "tanimoto") - Optional similarity
+//'     metric, see [similarity_metric()]
 //'   \item Returns: Dataframe with columns "id" and "similarity"
 //' }
+//' @field tanimoto_topk the k most similar fingerprints in the collection
+//'   for each of the given fingerprints \itemize{
+//'   \item Parameter: s - Fingerprints, optionally wrapped in [fingerprints()]
+//'     to specify encoding
+//'   \item Parameter: k - number of most similar fingerprints to return
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Parameter: metric (default "tanimoto") - Optional similarity
+//'     metric, see [similarity_metric()]
+//'   \item Returns: Dataframe with columns "id_1", "id_2", and "similarity",
+//'     with k rows per fingerprint ordered from most to least similar
+//' }
+//' @field build_vptree Build a vantage point tree over Tanimoto distance
+//'   for exact range searches. The tree takes 12 bytes per fingerprint.
+//'   \itemize{
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used to build the tree
+//' }
+//' @field tanimoto_range similarity between given fingerprints and the
+//'   fingerprints in the collection above the threshold, using the vantage
+//'   point tree to skip fingerprints that are too far away. Returns exactly
+//'   the same as `tanimoto_ext()` with a threshold. \itemize{
+//'   \item Parameter: s - Fingerprints, optionally wrapped in [fingerprints()]
+//'     to specify encoding
+//'   \item Parameter: threshold - only return fingerprints with Tanimoto
+//'     similarity above this threshold
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Returns: Dataframe with columns "id_1", "id_2", and "similarity"
+//' }
+//' @field build_hnsw Build a hierarchical navigable small world graph over
+//'   Tanimoto distance for approximate nearest neighbour searches. The graph
+//'   takes about 8 * M bytes per fingerprint. \itemize{
+//'   \item Parameter: M - number of links per fingerprint, 2 * M on the
+//'     bottom level. 16 is a good start, more links raise the recall of
+//'     searches and the build time.
+//'   \item Parameter: ef_construction - number of candidates considered when
+//'     linking a fingerprint, at least M. More candidates give a better graph
+//'     and take longer to build.
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used to build the graph
+//' }
+//' @field save_hnsw Save the HNSW graph to a file, e.g. next to the
+//'   fingerprints saved using `save_file()` \itemize{
+//'   \item Parameter: path - Path to location where the graph will be stored
+//'   \item Parameter: compression_level (default 3) - Optional integer between
+//'     0 and 22 specifying the level of compression used
+//' }
+//' @field load_hnsw Load an HNSW graph saved for the same fingerprints
+//'   \itemize{
+//'   \item Parameter: path - Path to the graph saved using `save_hnsw()`
+//' }
+//' @field search_approx approximately the k most similar fingerprints in the
+//'   collection for each of the given fingerprints, using the HNSW graph
+//'   \itemize{
+//'   \item Parameter: s - Fingerprints, optionally wrapped in [fingerprints()]
+//'     to specify encoding
+//'   \item Parameter: k - number of most similar fingerprints to return
+//'   \item Parameter: ef - number of candidates kept during the search, at
+//'     least k are used. Larger values raise the recall and take longer.
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Returns: Dataframe with columns "id_1", "id_2", and "similarity",
+//'     with up to k rows per fingerprint ordered from most to least similar
+//' }
+//' @field build_lsh Build an approximate similarity index using banded
+//'   MinHash over the bits set in each fingerprint. Two fingerprints with
+//'   Tanimoto similarity s are found with probability
+//'   \eqn{1 - (1 - s^{rows})^{bands}}. The index takes 8 bytes per band for
+//'   every fingerprint. \itemize{
+//'   \item Parameter: bands - number of bands, more bands raise the recall
+//'   \item Parameter: rows - number of MinHashes per band, more rows return
+//'     fewer dissimilar candidates
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used to build the index
+//' }
+//' @field save_lsh Save the LSH index to a file, e.g. next to the
+//'   fingerprints saved using `save_file()` \itemize{
+//'   \item Parameter: path - Path to location where the index will be stored
+//'   \item Parameter: compression_level (default 3) - Optional integer between
+//'     0 and 22 specifying the level of compression used
+//' }
+//' @field load_lsh Load an LSH index saved for the same fingerprints \itemize{
+//'   \item Parameter: path - Path to the index saved using `save_lsh()`
+//' }
+//' @field tanimoto_lsh similarity between given fingerprints and the
+//'   fingerprints in the collection above the threshold, among the
+//'   candidates found by the LSH index. Similarities are exact, but pairs
+//'   the index misses aren't returned. \itemize{
+//'   \item Parameter: s - Fingerprints, optionally wrapped in [fingerprints()]
+//'     to specify encoding
+//'   \item Parameter: threshold - only return fingerprints with similarity
+//'     above this threshold
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Parameter: metric (default "tanimoto") - Optional similarity
+//'     metric, see [similarity_metric()]. Candidates are always found by
+//'     Tanimoto similarity.
+//'   \item Returns: Dataframe with columns "id_1", "id_2", and "similarity"
+//' }
+//' @field screen_superset fingerprints in the collection that have all bits
+//'   of the given fingerprints set, e.g. as substructure screen \itemize{
+//'   \item Parameter: s - Fingerprints, optionally wrapped in [fingerprints()]
+//'     to specify encoding
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads used for the search
+//'   \item Returns: Dataframe with columns "id_1" and "id_2" of every
+//'     fingerprint and the fingerprints in the collection containing it.
+//'     The bit index used for the search is built on the first call and
+//'     takes 4 bytes for every bit set in the collection.
+//' }
+//' @field set_prefilter Keep folded summaries of all fingerprints that let
+//'   threshold and top-k searches skip most pairs that can't reach the
+//'   threshold without reading the full fingerprints. Results are unchanged.
+//'   \itemize{
+//'   \item Parameter: bits - 128 or 256 bits per summary, or 0 to turn the
+//'     prefilter off again. Larger summaries skip more pairs and use more
+//'     memory, 16 or 32 bytes per fingerprint.
+//' }
+//' @field set_bitsliced Keep a copy of the fingerprints in bit-sliced
+//'   layout, where each bit of 512 fingerprints is stored next to each other.
+//'   `tanimoto_all()` and `tanimoto_ext()` with a threshold then only read the
+//'   bits set in the query and compare it against 512 fingerprints at once,
+//'   giving up on a group as soon as none of them can reach the threshold.
+//'   `tanimoto_all()` without threshold uses it as well. Results are
+//'   unchanged. \itemize{
+//'   \item Parameter: enabled - TRUE to build the layout, which takes as much
+//'     memory as the fingerprints, or FALSE to drop it again
+//' }
 //' @field save_file Save fingerprints to file in binary format \itemize{
 //'   \item Parameter: path - Path to location where fingerprints will be stored
 //'   \item Parameter: compression_level (default 3) - Optional integer between
 //'     0 and 22 specifying the level of compression used. Higher values produce
 //'     smaller files at the cost of slowing down writing
+//'   \item Parameter: n_threads (default all cores) - Optional number of
+//'     threads compressing chunks of the fingerprints. Only one chunk per
+//'     thread is held in memory at a time, and loading decompresses the
+//'     chunks in parallel as well
+//'   \item Parameter: long_distance (default FALSE) - Optional, TRUE enables
+//'     zstd long distance matching, which finds repeated fingerprints further
+//'     apart within a chunk at some cost in speed
+//' }
+//' @field append_file Add the fingerprints to a file saved by `save_file()`
+//'   without rewriting it. They are written as a new segment after the last
+//'   complete one, and the header is only updated once it's complete, so an
+//'   interrupted append doesn't damage the file. Loading merges the segments
+//'   by name, which costs nothing if appended names are larger than those in
+//'   the file.
+//'   \itemize{
+//'   \item Parameter: path - Path to a file saved by `save_file()`, which must
+//'     not hold any of the names of the fingerprints
+//'   \item Parameters: compression_level, n_threads, long_distance - Optional,
+//'     as for `save_file()`
+//' }
+//' @field save_mapped Save fingerprints uncompressed in a format that can be
+//'   memory mapped and used in place when loaded \itemize{
+//'   \item Parameter: path - Path to location where fingerprints will be stored
 //' }
 //' @field n number of fingerprints
 //' @field size number of bytes used to store the fingerprints
+//' @field page_size size in bytes of the memory pages the fingerprints are
+//'   stored on, larger than the regular page size if they got huge pages,
+//'   see [huge_pages()]
 //' @importFrom Rcpp cpp_object_initializer
+//' @export MorganFPS1024 MorganFPS4096 MACCSFPS
 //' @export
-class MorganFPS {
+template <size_t fp_length>
+class FingerprintCollection {
 
 public:
 
+  using Fingerprint = FingerprintOf<fp_length>;
+
   // Constructor accepts a named character vector of hex strings
   // either in full hexadecimal format or in packed RDKIT format
-  MorganFPS(const CharacterVector& fps_hex) {
-    convert_fps(fps_hex, fp_names, fps);
+  FingerprintCollection(const CharacterVector& fps_hex) {
+    convert_fps<fp_length>(fps_hex, fp_names, fps);
+    count_bits();
   }
 
   // Constructor accepts a file path to load fingerprints from binary file
-  MorganFPS(const std::string& filename, const bool from_file) {
+  FingerprintCollection(const std::string& filename, const bool from_file) {
     read_file(filename);
+    count_bits();
+  }
+
+  // Only reads the names up front, fingerprints are read from the file as
+  // they are needed
+  FingerprintCollection(const std::string& filename, const bool from_file, const bool lazy_load) {
+    read_file(filename, lazy_load);
+    count_bits();
   }
 
   // Tanimoto similarity between drugs i and j
   double tanimoto(RObject &i, RObject &j) {
-    return jaccard_fp(fp_index(i), fp_index(j));
+    return pair_score(Tanimoto(), fp_position(i), fp_position(j));
+  }
+
+  double tanimoto(RObject &i, RObject &j, const CharacterVector& metric) {
+    const size_t pos_i = fp_position(i), pos_j = fp_position(j);
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->pair_score(m, pos_i, pos_j);
+    });
   }
 
   // Tanimoto similarity of drug i to every other drug
   DataFrame tanimoto_all(RObject &x) {
-    const Fingerprint fp_other = fp_index(x);
-    NumericVector res(fps.size());
-    for (int i = 0; i < fps.size(); i++) {
-      res[i] = jaccard_fp(fps[i], fp_other);
-    }
-    return DataFrame::create(
-      Named("id") = fp_names,
-      Named("similarity") = res
-    );
+    return all_scores(Tanimoto(), fp_position(x));
+  }
+
+  DataFrame tanimoto_all(RObject &x, const CharacterVector& metric) {
+    const size_t query = fp_position(x);
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->all_scores(m, query);
+    });
+  }
+
+  // Tanimoto similarity of drug i to every other drug above the threshold.
+  // Only fingerprints whose popcount can reach the threshold are compared.
+  DataFrame tanimoto_all(RObject &x, double threshold) {
+    return all_scores(Tanimoto(), fp_position(x), threshold);
+  }
+
+  DataFrame tanimoto_all(RObject &x, double threshold, const CharacterVector& metric) {
+    const size_t query = fp_position(x);
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->all_scores(m, query, threshold);
+    });
   }
 
   // Tanimoto similarity of all NxN combinations of fingerprints
+  //   above the threshold
   DataFrame tanimoto_threshold(double threshold) {
-    IntegerVector id_1;
-    IntegerVector id_2;
-    NumericVector sims;
-    for (int i = 0; i < fps.size(); i++) {
-      if (i % 10000 == 0)
-        Rcout << i << " done" << std::endl;
-      checkUserInterrupt();
-      for (int j = i + 1; j < fps.size(); j++) {
-        auto sim = jaccard_fp(fps[i], fps[j]);
-        if (sim > threshold) {
-          id_1.push_back(fp_names[i]);
-          id_2.push_back(fp_names[j]);
-          sims.push_back(sim);
+    return tanimoto_threshold(threshold, default_n_threads());
+  }
+
+  DataFrame tanimoto_threshold(double threshold, int n_threads) {
+    return threshold_scores(Tanimoto(), threshold, n_threads);
+  }
+
+  DataFrame tanimoto_threshold(double threshold, const CharacterVector& metric) {
+    return tanimoto_threshold(threshold, default_n_threads(), metric);
+  }
+
+  DataFrame tanimoto_threshold(double threshold, int n_threads, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->threshold_scores(m, threshold, n_threads);
+    });
+  }
+
+  // Tanimoto similarity of all NxN combinations of fingerprints above the
+  //   threshold, written to a file as they are found
+  List tanimoto_threshold_file(double threshold, const std::string& path) {
+    return tanimoto_threshold_file(threshold, path, default_n_threads());
+  }
+
+  List tanimoto_threshold_file(double threshold, const std::string& path, int n_threads) {
+    return threshold_file(Tanimoto(), threshold, path, n_threads);
+  }
+
+  List tanimoto_threshold_file(double threshold, const std::string& path, const CharacterVector& metric) {
+    return tanimoto_threshold_file(threshold, path, default_n_threads(), metric);
+  }
+
+  List tanimoto_threshold_file(double threshold, const std::string& path, int n_threads, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->threshold_file(m, threshold, path, n_threads);
+    });
+  }
+
+  // Tanimoto similarity of all NxN combinations of fingerprints above the
+  //   threshold as sparse matrix
+  S4 tanimoto_threshold_sparse(double threshold) {
+    return tanimoto_threshold_sparse(threshold, default_n_threads());
+  }
+
+  S4 tanimoto_threshold_sparse(double threshold, int n_threads) {
+    return threshold_sparse(Tanimoto(), threshold, n_threads);
+  }
+
+  S4 tanimoto_threshold_sparse(double threshold, const CharacterVector& metric) {
+    return tanimoto_threshold_sparse(threshold, default_n_threads(), metric);
+  }
+
+  S4 tanimoto_threshold_sparse(double threshold, int n_threads, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->threshold_sparse(m, threshold, n_threads);
+    });
+  }
+
+  // Butina clustering of all drugs with the given similarity threshold
+  DataFrame cluster_butina(double threshold) {
+    return cluster_butina(threshold, default_n_threads());
+  }
+
+  DataFrame cluster_butina(double threshold, int n_threads) {
+    return butina_clusters(Tanimoto(), threshold, n_threads);
+  }
+
+  DataFrame cluster_butina(double threshold, const CharacterVector& metric) {
+    return cluster_butina(threshold, default_n_threads(), metric);
+  }
+
+  DataFrame cluster_butina(double threshold, int n_threads, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->butina_clusters(m, threshold, n_threads);
+    });
+  }
+
+  // MaxMin selection of diverse drugs, starting from a random drug
+  DataFrame pick_diverse(int n_picks, int seed) {
+    return pick_diverse(n_picks, seed, default_n_threads());
+  }
+
+  DataFrame pick_diverse(int n_picks, int seed, int n_threads) {
+    return diverse_picks(Tanimoto(), n_picks, seed, n_threads);
+  }
+
+  DataFrame pick_diverse(int n_picks, int seed, const CharacterVector& metric) {
+    return pick_diverse(n_picks, seed, default_n_threads(), metric);
+  }
+
+  DataFrame pick_diverse(int n_picks, int seed, int n_threads, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->diverse_picks(m, n_picks, seed, n_threads);
+    });
+  }
+
+  // Tanimoto similarity of drug list vs the same or another drug list
+  DataFrame tanimoto_subset(RObject& x, RObject& y) {
+    return subset_scores(Tanimoto(), x, y);
+  }
+
+  DataFrame tanimoto_subset(RObject& x, RObject& y, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->subset_scores(m, x, y);
+    });
+  }
+
+  // Tanimoto similarity of drug list vs the same or another drug list above
+  //   the threshold as sparse matrix
+  S4 tanimoto_subset_sparse(RObject& x, RObject& y, double threshold) {
+    return subset_sparse(Tanimoto(), x, y, threshold);
+  }
+
+  S4 tanimoto_subset_sparse(RObject& x, RObject& y, double threshold, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->subset_sparse(m, x, y, threshold);
+    });
+  }
+
+  // Tanimoto similarity of all pairs of the given drugs as full matrix,
+  //   dist object or packed upper triangle
+  RObject tanimoto_matrix(RObject& ids) {
+    return tanimoto_matrix(ids, "matrix");
+  }
+
+  RObject tanimoto_matrix(RObject& ids, const std::string& format) {
+    return tanimoto_matrix(ids, format, "double");
+  }
+
+  RObject tanimoto_matrix(RObject& ids, const std::string& format, const std::string& precision) {
+    return tanimoto_matrix(ids, format, precision, default_n_threads());
+  }
+
+  RObject tanimoto_matrix(RObject& ids, const std::string& format, const std::string& precision, int n_threads) {
+    return matrix_scores(Tanimoto(), ids, format, precision, n_threads);
+  }
+
+  RObject tanimoto_matrix(
+      RObject& ids, const std::string& format, const std::string& precision,
+      int n_threads, const CharacterVector& metric
+  ) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->matrix_scores(m, ids, format, precision, n_threads);
+    });
+  }
+
+  // Tanimoto similarity of an external drug to every other drug
+  //   in the collection
+  DataFrame tanimoto_ext(const CharacterVector& others) {
+    return ext_scores(Tanimoto(), others);
+  }
+
+  DataFrame tanimoto_ext(const CharacterVector& others, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->ext_scores(m, others);
+    });
+  }
+
+  // Tanimoto similarity of external drugs to drugs in the collection
+  //   above the threshold
+  DataFrame tanimoto_ext(const CharacterVector& others, double threshold) {
+    return ext_scores(Tanimoto(), others, threshold);
+  }
+
+  DataFrame tanimoto_ext(const CharacterVector& others, double threshold, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->ext_scores(m, others, threshold);
+    });
+  }
+
+  // The k most similar drugs in the collection for each of the external drugs
+  DataFrame tanimoto_topk(const CharacterVector& others, int k) {
+    return tanimoto_topk(others, k, default_n_threads());
+  }
+
+  DataFrame tanimoto_topk(const CharacterVector& others, int k, int n_threads) {
+    return topk_scores(Tanimoto(), others, k, n_threads);
+  }
+
+  DataFrame tanimoto_topk(const CharacterVector& others, int k, const CharacterVector& metric) {
+    return tanimoto_topk(others, k, default_n_threads(), metric);
+  }
+
+  DataFrame tanimoto_topk(const CharacterVector& others, int k, int n_threads, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->topk_scores(m, others, k, n_threads);
+    });
+  }
+
+  // Build MinHash LSH index for approximate searches
+  void build_lsh(int bands, int rows) {
+    build_lsh(bands, rows, default_n_threads());
+  }
+
+  void build_lsh(int bands, int rows, int n_threads) {
+    require_fingerprints();
+    if (bands < 1 || rows < 1)
+      stop("Number of bands and rows must be positive");
+    if (bands * rows > 1024)
+      stop("At most 1024 hash functions (bands * rows) are supported");
+    if (fps.size() > UINT32_MAX)
+      stop("Too many fingerprints for the LSH index");
+    lsh.build(fps, bands, rows, 42, n_threads);
+  }
+
+  void save_lsh(const std::string& path) {
+    save_lsh(path, 3);
+  }
+
+  void save_lsh(const std::string& path, int compression_level) {
+    if (lsh.empty())
+      stop("No LSH index, build one using build_lsh()");
+    lsh.save(path, compression_level);
+  }
+
+  // Load LSH index saved for the same drugs
+  void load_lsh(const std::string& path) {
+    require_fingerprints();
+    MinHashIndex index;
+    index.load(path);
+    if (index.n_bits != static_cast<size_t>(n_bits) || index.n != fps.size() ||
+        index.checksum != fingerprints_checksum(fps))
+      stop("LSH index in %s was built for different fingerprints", path);
+    lsh = std::move(index);
+  }
+
+  // Drugs in the collection similar to the external drugs above the threshold,
+  //   among the candidates found by the LSH index
+  DataFrame tanimoto_lsh(const CharacterVector& others, double threshold) {
+    return tanimoto_lsh(others, threshold, default_n_threads());
+  }
+
+  DataFrame tanimoto_lsh(const CharacterVector& others, double threshold, int n_threads) {
+    return lsh_scores(Tanimoto(), others, threshold, n_threads);
+  }
+
+  DataFrame tanimoto_lsh(const CharacterVector& others, double threshold, const CharacterVector& metric) {
+    return tanimoto_lsh(others, threshold, default_n_threads(), metric);
+  }
+
+  DataFrame tanimoto_lsh(const CharacterVector& others, double threshold, int n_threads, const CharacterVector& metric) {
+    return with_metric(parse_metric(metric), [&](auto m) {
+      return this->lsh_scores(m, others, threshold, n_threads);
+    });
+  }
+
+  // Build vantage point tree for exact range searches
+  void build_vptree() {
+    build_vptree(default_n_threads());
+  }
+
+  void build_vptree(int n_threads) {
+    require_fingerprints();
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+    if (fps.size() > UINT32_MAX)
+      stop("Too many fingerprints for the vantage point tree");
+    const auto count_and = kernels().count_and;
+    vptree.build(n(), n_threads, [&](std::uint32_t i, std::uint32_t j) {
+      return tanimoto_distance(count_and(fps[i], fps[j]), fp_counts[i], fp_counts[j]);
+    });
+  }
+
+  // Tanimoto similarity of external drugs to drugs in the collection above
+  //   the threshold, found using the vantage point tree
+  DataFrame tanimoto_range(const CharacterVector& others, double threshold) {
+    return tanimoto_range(others, threshold, default_n_threads());
+  }
+
+  DataFrame tanimoto_range(const CharacterVector& others, double threshold, int n_threads) {
+    if (vptree.empty() && n() > 0)
+      stop("No vantage point tree, build one using build_vptree()");
+    std::vector<FingerprintName> other_names;
+    std::vector<Fingerprint> other_fps;
+    convert_fps<fp_length>(others, other_names, other_fps);
+    const auto count = kernels().count;
+    const auto count_and = kernels().count_and;
+    std::vector<std::vector<std::pair<size_t, double>>> hits(other_fps.size());
+    parallel_for(other_fps.size(), n_threads, [&](size_t j, int worker) {
+      const Fingerprint& fp = other_fps[j];
+      const int count_j = count(fp);
+      vptree.search(
+        [&](std::uint32_t i) {
+          return tanimoto_distance(count_and(fp, fps[i]), count_j, fp_counts[i]);
+        },
+        1 - threshold,
+        [&](std::uint32_t i) {
+          if (!(rank_bound(Tanimoto(), count_j, fp_counts[i]) > threshold))
+            return;
+          const double sim = Tanimoto()(count_and(fp, fps[i]), count_j, fp_counts[i]);
+          if (sim > threshold)
+            hits[j].emplace_back(i, sim);
         }
-      }
+      );
+    });
+    // Same order as tanimoto_ext(), by drug in the collection and then by
+    // external drug
+    std::vector<std::tuple<size_t, size_t, double>> sorted;
+    for (size_t j = 0; j < hits.size(); j++)
+      for (auto& hit: hits[j])
+        sorted.emplace_back(hit.first, j, hit.second);
+    std::sort(sorted.begin(), sorted.end());
+    IntegerVector id_1(sorted.size());
+    IntegerVector id_2(sorted.size());
+    NumericVector sim(sorted.size());
+    for (size_t idx = 0; idx < sorted.size(); idx++) {
+      id_1[idx] = other_names[std::get<1>(sorted[idx])];
+      id_2[idx] = fp_names[std::get<0>(sorted[idx])];
+      sim[idx] = std::get<2>(sorted[idx]);
     }
     return DataFrame::create(
       Named("id_1") = id_1,
       Named("id_2") = id_2,
-      Named("similarity") = sims
+      Named("similarity") = sim
     );
   }
 
-  // Tanimoto similarity of drug list vs the same or another drug list
-  DataFrame tanimoto_subset(RObject& x, RObject& y) {
-    auto x_names = convert_sort_name_vec(x);
-    auto x_fps = fp_index(x_names);
-    std::vector<FingerprintName> x_name;
-    std::vector<FingerprintName> y_name;
-    std::vector<double> similarity;
-    size_t n_total;
-    if (y.isNULL()) {
-      n_total = x_names.size() * n();
-      x_name.reserve(n_total);
-      y_name.reserve(n_total);
-      similarity.reserve(n_total);
-      for (int i = 0; i < x_names.size(); i++) {
-        for (int j = 0; j < n(); j++) {
-          x_name.push_back(x_names.at(i));
-          y_name.push_back(fp_names.at(j));
-          similarity.push_back(jaccard_fp(x_fps.at(i), fps.at(j)));
-        }
+  // Build HNSW graph for approximate nearest neighbour searches
+  void build_hnsw(int M, int ef_construction) {
+    build_hnsw(M, ef_construction, default_n_threads());
+  }
+
+  void build_hnsw(int M, int ef_construction, int n_threads) {
+    require_fingerprints();
+    if (M < 2 || M > 256)
+      stop("M must be between 2 and 256");
+    if (ef_construction < M)
+      stop("ef_construction must be at least M");
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+    if (fps.size() > UINT32_MAX)
+      stop("Too many fingerprints for the HNSW index");
+    const auto count_and = kernels().count_and;
+    hnsw.build(
+      n(), M, ef_construction, 42, fingerprints_checksum(fps), n_threads,
+      [&](std::uint32_t i, std::uint32_t j) {
+        return tanimoto_distance(count_and(fps[i], fps[j]), fp_counts[i], fp_counts[j]);
       }
-    } else {
-      auto y_names = convert_sort_name_vec(y);
-      auto y_fps = fp_index(y_names);
-      n_total = x_names.size() * y_names.size();
-      x_name.reserve(n_total);
-      y_name.reserve(n_total);
-      similarity.reserve(n_total);
-      for (int i = 0; i < x_names.size(); i++) {
-        for (int j = 0; j < y_names.size(); j++) {
-          x_name.push_back(x_names.at(i));
-          y_name.push_back(y_names.at(j));
-          similarity.push_back(jaccard_fp(x_fps.at(i), y_fps.at(j)));
-        }
+    );
+  }
+
+  void save_hnsw(const std::string& path) {
+    save_hnsw(path, 3);
+  }
+
+  void save_hnsw(const std::string& path, int compression_level) {
+    if (hnsw.empty())
+      stop("No HNSW index, build one using build_hnsw()");
+    hnsw.save(path, compression_level);
+  }
+
+  // Load HNSW index saved for the same drugs
+  void load_hnsw(const std::string& path) {
+    require_fingerprints();
+    HnswIndex index;
+    index.load(path);
+    if (index.n != fps.size() || index.checksum != fingerprints_checksum(fps))
+      stop("HNSW index in %s was built for different fingerprints", path);
+    hnsw = std::move(index);
+  }
+
+  // Approximately the k most similar drugs in the collection for each of the
+  //   external drugs, found using the HNSW index
+  DataFrame search_approx(const CharacterVector& others, int k, int ef) {
+    return search_approx(others, k, ef, default_n_threads());
+  }
+
+  DataFrame search_approx(const CharacterVector& others, int k, int ef, int n_threads) {
+    if (hnsw.empty())
+      stop("No HNSW index, build one using build_hnsw() or load it using load_hnsw()");
+    if (k < 1 || ef < 1)
+      stop("k and ef must be positive");
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+    std::vector<FingerprintName> other_names;
+    std::vector<Fingerprint> other_fps;
+    convert_fps<fp_length>(others, other_names, other_fps);
+    const auto count = kernels().count;
+    const auto count_and = kernels().count_and;
+    std::vector<HnswIndex::VisitedTags> visited(n_threads);
+    std::vector<std::vector<HnswIndex::Neighbour>> hits(other_fps.size());
+    parallel_for(other_fps.size(), n_threads, [&](size_t j, int worker) {
+      const Fingerprint& fp = other_fps[j];
+      const int count_j = count(fp);
+      hits[j] = hnsw.search(
+        [&](std::uint32_t i) {
+          return tanimoto_distance(count_and(fp, fps[i]), count_j, fp_counts[i]);
+        },
+        k, ef, visited[worker]
+      );
+      for (auto& hit: hits[j])
+        hit.first = Tanimoto()(count_and(fp, fps[hit.second]), count_j, fp_counts[hit.second]);
+    });
+    size_t nn = 0;
+    for (auto& h: hits)
+      nn += h.size();
+    IntegerVector id_1(nn);
+    IntegerVector id_2(nn);
+    NumericVector sim(nn);
+    size_t idx = 0;
+    for (size_t j = 0; j < hits.size(); j++) {
+      for (auto& hit: hits[j]) {
+        id_1[idx] = other_names[j];
+        id_2[idx] = fp_names[hit.second];
+        sim[idx] = hit.first;
+        idx++;
       }
     }
     return DataFrame::create(
-      Named("id_1") = x_name,
-      Named("id_2") = y_name,
-      Named("similarity") = similarity
+      Named("id_1") = id_1,
+      Named("id_2") = id_2,
+      Named("similarity") = sim
     );
   }
 
-  // Tanimoto similarity of an external drug to every other drug
-  //   in the collection
-  DataFrame tanimoto_ext(const CharacterVector& others) {
+  // Drugs in the collection that have all bits of the external drugs set
+  DataFrame screen_superset(const CharacterVector& others) {
+    return screen_superset(others, default_n_threads());
+  }
+
+  DataFrame screen_superset(const CharacterVector& others, int n_threads) {
+    require_fingerprints();
     std::vector<FingerprintName> other_names;
     std::vector<Fingerprint> other_fps;
-    convert_fps(others, other_names, other_fps);
-    size_t nn = other_fps.size() * n();
+    convert_fps<fp_length>(others, other_names, other_fps);
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+    if (fps.size() > UINT32_MAX)
+      stop("Too many fingerprints for the bit index");
+    if (postings.empty())
+      postings.build(fps);
+    const auto count = kernels().count;
+    std::vector<std::vector<std::uint32_t>> hits(other_fps.size());
+    parallel_for(other_fps.size(), n_threads, [&](size_t j, int worker) {
+      hits[j] = superset_search(other_fps[j], count(other_fps[j]));
+    });
+    size_t nn = 0;
+    for (auto& h: hits)
+      nn += h.size();
     IntegerVector id_1(nn);
     IntegerVector id_2(nn);
-    NumericVector sim(nn);
     size_t idx = 0;
-    for (size_t i = 0; i < n(); i++) {
-      for (size_t j = 0; j < other_fps.size(); j++) {
-        sim[idx] = jaccard_fp(fps[i], other_fps[j]);
+    for (size_t j = 0; j < hits.size(); j++) {
+      for (auto i: hits[j]) {
         id_1[idx] = other_names[j];
         id_2[idx] = fp_names[i];
         idx++;
@@ -248,132 +948,1468 @@ public:
     }
     return DataFrame::create(
       Named("id_1") = id_1,
-      Named("id_2") = id_2,
-      Named("similarity") = sim
+      Named("id_2") = id_2
     );
   }
 
+  // Keep folded summaries of all drugs to skip hopeless pairs in threshold
+  // and top-k searches. 0 bits turns the prefilter off.
+  void set_prefilter(int bits) {
+    require_fingerprints();
+    if (bits != 0 && bits != 128 && bits != 256)
+      stop("Prefilter must have 0, 128 or 256 bits");
+    if (bits >= static_cast<int>(fp_length))
+      stop("Prefilter must have fewer bits than the fingerprints");
+    folded_128.clear();
+    folded_256.clear();
+    if (bits == 128)
+      folded_128.build(fps);
+    else if (bits == 256)
+      folded_256.build(fps);
+    prefilter_bits = bits;
+  }
+
+  // Keep the drugs in bit-sliced layout for tanimoto_all() and thresholded
+  // tanimoto_ext()
+  void set_bitsliced(bool enabled) {
+    require_fingerprints();
+    if (enabled)
+      bitslices.build(fps, count_order);
+    else
+      bitslices.clear();
+  }
+
   void save_file(const std::string& filename) {
     save_file(filename, 3);
   }
 
+  void save_file(const std::string& filename, const int& compression_level) {
+    save_file(filename, compression_level, default_n_threads(), false);
+  }
+
+  void save_file(const std::string& filename, int compression_level, int n_threads) {
+    save_file(filename, compression_level, n_threads, false);
+  }
+
   // Save binary fp file
-  void save_file(const std::string& filename, const int& compression_level=3) {
-    if (compression_level < 1 || compression_level > 22)
-      stop("Compression level must be between 0 and 22. Default = 3");
+  void save_file(const std::string& filename, int compression_level, int n_threads, bool long_distance) {
+    require_fingerprints();
+    check_save_options(compression_level, n_threads);
 
     FingerprintN n = fps.size();
     Rcout << "Wrinting " << n << " fingerprints\n";
 
     std::ofstream out_stream;
     out_stream.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
-    size_t input_size;
-
-    std::vector<char> out_buffer;
 
-    // out_stream << "MORGANFPS";
-    out_stream.write("MORGANFPS", 9);
+    // Header records the format version and fingerprint length, files
+    // starting with "MORGANFPS" predate it and hold 2048 bit fingerprints.
+    // Version 3 is followed by segments of fingerprints in chunks, see
+    // write_segment(). append_file() adds segments and updates the total
+    // number of fingerprints and segments in the header.
+    std::uint32_t version = 3;
+    std::uint32_t length = fp_length;
+    std::uint64_t n_segments = 1;
+    out_stream.write("MORGANFPX", 9);
+    out_stream.write(reinterpret_cast<char*>(&version), sizeof(version));
+    out_stream.write(reinterpret_cast<char*>(&length), sizeof(length));
     out_stream.write(reinterpret_cast<char*>(&n), sizeof(FingerprintN));
+    out_stream.write(reinterpret_cast<char*>(&n_segments), sizeof(n_segments));
+    write_segment(out_stream, compression_level, n_threads, long_distance);
 
-    input_size = fps.size() * sizeof(Fingerprint);
-    out_buffer.resize(ZSTD_compressBound(input_size));
-    const size_t fingerprints_compressed = ZSTD_compress(
-      out_buffer.data(), out_buffer.size(),
-      reinterpret_cast<char *>(fps.data()), input_size,
-      compression_level
-    );
-    if (ZSTD_isError(fingerprints_compressed)) {
-      stop("Error compressing fingerprints: %s", ZSTD_getErrorName(fingerprints_compressed));
-    }
+    if (!out_stream)
+      stop("Error writing %s", filename);
+    out_stream.close();
+  }
 
-    Rcout << "Fingerprints compressed " << fingerprints_compressed << " bytes\n";
-    // Save number of bytes of the compressed data. Important for finding
-    // second block with names for decompression
-    out_stream.write(reinterpret_cast<const char*>(&fingerprints_compressed), sizeof(size_t));
-    out_stream.write(out_buffer.data(), fingerprints_compressed);
-    Rcout << "Wrote fingerprints\n";
+  void append_file(const std::string& filename) {
+    append_file(filename, 3, default_n_threads(), false);
+  }
 
-    input_size = fp_names.size() * sizeof(FingerprintName);
-    out_buffer.resize(ZSTD_compressBound(input_size));
-    const size_t names_compressed = ZSTD_compress(
-      out_buffer.data(), out_buffer.size(),
-      reinterpret_cast<char *>(fp_names.data()), input_size,
-      compression_level
-    );
-    if (ZSTD_isError(names_compressed)) {
-      stop("Error compressing fingerprint names: %s", ZSTD_getErrorName(names_compressed));
+  void append_file(const std::string& filename, int compression_level) {
+    append_file(filename, compression_level, default_n_threads(), false);
+  }
+
+  void append_file(const std::string& filename, int compression_level, int n_threads) {
+    append_file(filename, compression_level, n_threads, false);
+  }
+
+  // Add the fingerprints as a new segment after the last segment of a file
+  // saved by save_file(). The header is only updated once the segment is
+  // written, so an interrupted append leaves the segments as they were. Bytes
+  // it left after the last segment are ignored when reading and overwritten
+  // by the next append.
+  void append_file(const std::string& filename, int compression_level, int n_threads, bool long_distance) {
+    require_fingerprints();
+    check_save_options(compression_level, n_threads);
+    FingerprintN n_file;
+    std::uint64_t n_segments;
+    std::streampos end;
+    {
+      std::ifstream in_stream(filename, std::ios::in | std::ios::binary);
+      if (!in_stream)
+        stop("Can't open %s", filename);
+      const std::uint32_t version = read_header(in_stream);
+      if (version != 3)
+        stop("Only files saved by save_file() of this version can be appended to");
+      in_stream.read(reinterpret_cast<char*>(&n_file), sizeof(n_file));
+      in_stream.read(reinterpret_cast<char*>(&n_segments), sizeof(n_segments));
+      std::vector<FingerprintName> file_names(n_file);
+      read_segments(in_stream, version, n_file, n_segments, file_names.data(), nullptr);
+      end = in_stream.tellg();
+      if (end < 0)
+        stop("Can't find the end of the last segment of %s", filename);
+      std::sort(file_names.begin(), file_names.end());
+      std::vector<FingerprintName> common;
+      std::set_intersection(
+        file_names.begin(), file_names.end(), fp_names.begin(), fp_names.end(),
+        std::back_inserter(common)
+      );
+      if (!common.empty())
+        stop("Fingerprint %i is already in the file. Duplicate names are not allowed", common[0]);
     }
+    if (fps.empty())
+      return;
+    Rcout << "Appending " << fps.size() << " fingerprints\n";
 
-    Rcout << "Names compressed " << names_compressed << " bytes\n";
-    // Save number of bytes of the compressed data. Important for finding
-    // second block with names for decompression
-    out_stream.write(reinterpret_cast<const char*>(&names_compressed), sizeof(size_t));
-    out_stream.write(out_buffer.data(), names_compressed);
-    Rcout << "Wrote Names\n";
+    std::ofstream out_stream(filename, std::ios::in | std::ios::out | std::ios::binary);
+    if (!out_stream)
+      stop("Can't open %s for writing", filename);
+    out_stream.seekp(end);
+    write_segment(out_stream, compression_level, n_threads, long_distance);
+    out_stream.flush();
+    if (!out_stream)
+      stop("Error writing %s", filename);
+    const FingerprintN n = n_file + fps.size();
+    n_segments++;
+    out_stream.seekp(count_offset);
+    out_stream.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    out_stream.write(reinterpret_cast<const char*>(&n_segments), sizeof(n_segments));
+    if (!out_stream)
+      stop("Error writing %s", filename);
+  }
 
-    out_stream.close();
+  // Save in mapped format, uncompressed with every section aligned to 64
+  // bytes, so that it can be used in place
+  void save_mapped(const std::string& filename) {
+    require_fingerprints();
+    std::ofstream out_stream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out_stream)
+      stop("Can't open %s", filename);
+    const MappedLayout layout(fps.size());
+    std::vector<char> header(MappedLayout::header_size, 0);
+    const std::uint32_t version = MappedLayout::version;
+    const std::uint32_t length = fp_length;
+    const FingerprintN n = fps.size();
+    std::memcpy(header.data(), "MORGANMAP", 9);
+    std::memcpy(header.data() + 9, &version, sizeof(version));
+    std::memcpy(header.data() + 13, &length, sizeof(length));
+    std::memcpy(header.data() + 17, &n, sizeof(n));
+    out_stream.write(header.data(), header.size());
+    auto write_section = [&](size_t offset, const void* data, size_t bytes) {
+      const std::vector<char> padding(offset - out_stream.tellp(), 0);
+      out_stream.write(padding.data(), padding.size());
+      out_stream.write(static_cast<const char*>(data), bytes);
+    };
+    write_section(layout.counts, fp_counts.data(), n * sizeof(std::int32_t));
+    write_section(layout.fingerprints, fps.data(), n * sizeof(Fingerprint));
+    write_section(layout.names, fp_names.data(), n * sizeof(FingerprintName));
+    if (!out_stream)
+      stop("Error writing %s", filename);
   }
 
   // Size of the dataset in bytes
   int size() {
-    return fps.size() * sizeof(Fingerprint);
+    return fps.size() * sizeof(Fingerprint) + lazy.cached_size();
+  }
+
+  // Size of the pages backing the fingerprints in bytes
+  size_t page_size() {
+    return page_size_at(fps.data());
   }
 
   // Number of elements
   size_t n() {
-    return fps.size();
+    return fp_names.size();
   }
 
-  std::vector<Fingerprint> fps;
+  // Aligned to cache lines, on huge pages if set by huge_pages() when the
+  // collection was created, or used in place from a file in mapped format
+  Storage<Fingerprint> fps;
   std::vector<FingerprintName> fp_names;
+  // Number of bits set in each fingerprint, computed once on construction
+  std::vector<int> fp_counts;
+  // Positions of fingerprints ordered by their number of set bits. Fingerprints
+  // with c bits set are at count_order[count_offsets[c]:count_offsets[c + 1]]
+  std::vector<std::uint32_t> count_order;
+  std::vector<size_t> count_offsets;
 
-private:
+  // Tree built by build_vptree()
+  VpTree vptree;
 
-  Fingerprint& fp_index(RObject& x) {
-    FingerprintName x_name = convert_name(x);
-    auto fp_pt = std::lower_bound(fp_names.begin(), fp_names.end(), x_name);
-    if (*fp_pt != x_name)
-      stop("Fingerprint %i not found", x_name);
-    return fps.at(fp_pt - fp_names.begin());
-  }
+  // Graph built by build_hnsw() or loaded by load_hnsw()
+  HnswIndex hnsw;
 
-  std::vector<std::reference_wrapper<Fingerprint>> fp_index(std::vector<FingerprintName>& names) {
-    std::vector<std::reference_wrapper<Fingerprint>> hits;
-    hits.reserve(names.size());
-    auto last_idx = fp_names.begin();
-    std::vector<FingerprintName>::iterator cur_idx;
-    for (auto x: names) {
-      cur_idx = std::lower_bound(last_idx, fp_names.end(), x);
-      if (*cur_idx != x)
-        stop("Fingerprint %i not found", x);
-      else
-        hits.push_back(std::ref(fps.at(cur_idx - fp_names.begin())));
-        last_idx = cur_idx;
-    }
-    return hits;
-  }
+  // MinHash index built by build_lsh() or loaded by load_lsh()
+  MinHashIndex lsh;
 
-  void read_file(std::string filename) {
-    std::ifstream in_stream;
-    in_stream.open(filename, std::ios::in | std::ios::binary);
+  // Positions of the fingerprints with each bit set, built on the first
+  // superset screen
+  BitPostings postings;
 
-    // std::in_stream in_stream(filename, std::ios::in | std::ios::binary);
-    // std::vector<char> file_buffer(std::istreambuf_iterator<char>(input), {});
-    // std::vector<char> decompressed_buffer;
+  // Folded summaries of the fingerprints, only the one selected by
+  // prefilter_bits is filled
+  int prefilter_bits = 0;
+  FoldedSummaries<2> folded_128;
+  FoldedSummaries<4> folded_256;
 
-    char magic[] = "xORGANFPS";
-    in_stream.read(magic, 9);
+  // Fingerprints in popcount order as bit planes, built by set_bitsliced()
+  BitSlices bitslices;
 
-    if (strcmp(magic, "MORGANFPS") != 0) {
-      stop("File is incompatible, doesn't start with 'MORGANFPS': '%s'", magic);
-    }
+  // File the fingerprints are read from on demand if the collection was
+  // loaded lazily, fps is empty until a method needs all of them
+  LazyChunks<Fingerprint> lazy;
+
+  // Bits that can be set, fp_length rounded up to whole words
+  static constexpr int n_bits = sizeof(Fingerprint) * 8;
+
+private:
+
+  static const PopcountKernels<std::tuple_size<Fingerprint>::value>& kernels() {
+    return popcount_kernels_for<Fingerprint>();
+  }
+
+  // Call f with the folded summaries selected by set_prefilter(), so that
+  // searches are compiled without the prefilter when it isn't used
+  template <typename F>
+  auto with_prefilter(F f) -> decltype(f(NoPrefilter())) {
+    if (prefilter_bits == 128)
+      return f(folded_128);
+    if (prefilter_bits == 256)
+      return f(folded_256);
+    return f(NoPrefilter());
+  }
+
+  // Intersection counts of fp with the fingerprints at positions [begin, end)
+  // of count_order from the bit-sliced layout, see BitSlices::count_and()
+  template <typename MinShared, typename F>
+  void sliced_count_and(const Fingerprint& fp, size_t begin, size_t end, MinShared min_shared, F f) {
+    bitslices.count_and(bitslices.query_bits(fp), begin, end, min_shared, f);
+  }
+
+  // Tanimoto distance used by the HNSW index and vantage point tree. It is a
+  // metric (Levandowsky & Winter 1971). Two empty fingerprints are
+  // identical rather than undefined, so distances can always be ordered.
+  static double tanimoto_distance(int count_and, int count_a, int count_b) {
+    const int count_or = count_a + count_b - count_and;
+    return count_or == 0 ? 0.0 : 1.0 - static_cast<double>(count_and) / count_or;
+  }
+
+  // Score of query fingerprint at position i against the one at position j.
+  // Only the intersection needs to be counted, the popcounts are cached.
+  template <typename Metric>
+  double pair_score(const Metric& metric, size_t i, size_t j) {
+    if (!lazy.empty()) {
+      const Fingerprint fp_i = lazy.get(i), fp_j = lazy.get(j);
+      return metric(
+        kernels().count_and(fp_i, fp_j), kernels().count(fp_i), kernels().count(fp_j)
+      );
+    }
+    return metric(
+      kernels().count_and(fps[i], fps[j]), fp_counts[i], fp_counts[j]
+    );
+  }
+
+  template <typename Metric>
+  DataFrame all_scores(const Metric& metric, size_t query) {
+    require_fingerprints();
+    NumericVector res(fps.size());
+    if (!bitslices.empty()) {
+      const int count = fp_counts[query];
+      sliced_count_and(fps[query], 0, n(), [](size_t, size_t) { return 0; },
+        [&](size_t p, int count_and) {
+          const std::uint32_t i = count_order[p];
+          res[i] = metric(count_and, count, fp_counts[i]);
+        }
+      );
+    } else {
+      for (size_t i = 0; i < fps.size(); i++) {
+        res[i] = pair_score(metric, query, i);
+      }
+    }
+    return DataFrame::create(
+      Named("id") = fp_names,
+      Named("similarity") = res
+    );
+  }
+
+  template <typename Metric>
+  DataFrame all_scores(const Metric& metric, size_t query, double threshold) {
+    require_fingerprints();
+    auto hits = window_search(metric, fps[query], fp_counts[query], threshold);
+    IntegerVector ids(hits.size());
+    NumericVector res(hits.size());
+    for (size_t i = 0; i < hits.size(); i++) {
+      ids[i] = fp_names[hits[i].first];
+      res[i] = hits[i].second;
+    }
+    return DataFrame::create(
+      Named("id") = ids,
+      Named("similarity") = res
+    );
+  }
+
+  template <typename Metric>
+  DataFrame threshold_scores(const Metric& metric, double threshold, int n_threads) {
+    require_fingerprints();
+    const TiledPairs hits = threshold_pairs(metric, threshold, n_threads);
+    const size_t n_hits = hits.size();
+    IntegerVector id_1(n_hits);
+    IntegerVector id_2(n_hits);
+    NumericVector sims(n_hits);
+    size_t idx = 0;
+    // Sorted by id_1 and then id_2 whatever the order of the tiles
+    hits.for_each_sorted(n(), [&](std::uint32_t i, std::uint32_t j, double sim) {
+      id_1[idx] = fp_names[i];
+      id_2[idx] = fp_names[j];
+      sims[idx] = sim;
+      idx++;
+    });
+    return DataFrame::create(
+      Named("id_1") = id_1,
+      Named("id_2") = id_2,
+      Named("similarity") = sims
+    );
+  }
+
+  template <typename Metric>
+  List threshold_file(
+      const Metric& metric, double threshold, const std::string& path, int n_threads
+  ) {
+    require_fingerprints();
+    check_threshold_search(metric, n_threads);
+    const TriangleTiles tiles(fps.size(), n_threads);
+    PairFileWriter writer(path, n_threads, 3);
+    threshold_search(
+      metric, threshold, tiles, n_threads,
+      [&](int worker, std::uint32_t i, std::uint32_t j, double sim) {
+        writer.push_back(worker, fp_names[i], fp_names[j], sim);
+      },
+      [](size_t tile, int worker) {}
+    );
+    const std::uint64_t n_pairs = writer.close();
+    return List::create(
+      Named("path") = path,
+      Named("n") = static_cast<double>(n_pairs)
+    );
+  }
+
+  template <typename Metric>
+  S4 threshold_sparse(const Metric& metric, double threshold, int n_threads) {
+    require_fingerprints();
+    const TiledPairs hits = threshold_pairs(metric, threshold, n_threads);
+    const CompressedColumns m = compress_columns(
+      n(), n(), hits.size(), [&](auto f) { hits.for_each(f); }
+    );
+    const CharacterVector names = name_strings(fp_names);
+    return sparse_matrix(m, names, names, true);
+  }
+
+  template <typename Metric>
+  S4 subset_sparse(const Metric& metric, RObject& x, RObject& y, double threshold) {
+    require_fingerprints();
+    auto x_names = convert_sort_name_vec(x);
+    auto x_pos = fp_positions(x_names);
+    std::vector<FingerprintName> y_names;
+    std::vector<size_t> y_pos;
+    if (y.isNULL()) {
+      y_names = fp_names;
+      y_pos.resize(n());
+      std::iota(y_pos.begin(), y_pos.end(), 0);
+    } else {
+      y_names = convert_sort_name_vec(y);
+      y_pos = fp_positions(y_names);
+    }
+    const double min_rank = rank<Metric>(threshold);
+    std::vector<std::uint32_t> rows, cols;
+    std::vector<double> sims;
+    blocked_count_and(
+      fp_pointers(x_pos), fp_pointers(y_pos),
+      [&](size_t i, size_t j, int count_and) {
+        const double sim = metric(count_and, fp_counts[x_pos[i]], fp_counts[y_pos[j]]);
+        if (rank<Metric>(sim) > min_rank) {
+          rows.push_back(i);
+          cols.push_back(j);
+          sims.push_back(sim);
+        }
+      }
+    );
+    const CompressedColumns m = compress_columns(
+      x_pos.size(), y_pos.size(), sims.size(), [&](auto f) {
+        for (size_t k = 0; k < sims.size(); k++)
+          f(rows[k], cols[k], sims[k]);
+      }
+    );
+    return sparse_matrix(m, name_strings(x_names), name_strings(y_names), false);
+  }
+
+  // Similarities of all pairs of the given fingerprints. Only the upper
+  // triangle is computed, split into tiles that are distributed over n_threads
+  // workers. Calls store(p, q, similarity) with p < q for every pair of
+  // positions in pos on the worker threads.
+  template <typename Metric, typename Store>
+  void triangle_scores(
+      const Metric& metric, const std::vector<size_t>& pos, int n_threads, Store store
+  ) {
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+    if (!metric.symmetric())
+      stop("Similarity matrices require a symmetric metric");
+    const TriangleTiles tiles(pos.size(), n_threads);
+    const auto count_and = kernels().count_and;
+    parallel_for(tiles.size(), n_threads, [&](size_t tile, int worker) {
+      const size_t col_begin = tiles.col_begin(tile);
+      const size_t col_end = tiles.col_end(tile);
+      for (size_t p = tiles.row_begin(tile); p < tiles.row_end(tile); p++) {
+        const size_t i = pos[p];
+        for (size_t q = std::max(p + 1, col_begin); q < col_end; q++) {
+          const size_t j = pos[q];
+          store(p, q, metric(count_and(fps[i], fps[j]), fp_counts[i], fp_counts[j]));
+        }
+      }
+    });
+  }
+
+  template <typename Metric>
+  RObject matrix_scores(
+      const Metric& metric, RObject& ids, const std::string& format,
+      const std::string& precision, int n_threads
+  ) {
+    require_fingerprints();
+    std::vector<FingerprintName> names;
+    std::vector<size_t> pos;
+    if (ids.isNULL()) {
+      names = fp_names;
+      pos.resize(n());
+      std::iota(pos.begin(), pos.end(), 0);
+    } else {
+      names = convert_sort_name_vec(ids);
+      pos = fp_positions(names);
+    }
+    if (precision != "double" && format != "packed")
+      stop("Precision '%s' is only available for packed output", precision);
+    const size_t n_ids = pos.size();
+    const size_t n_pairs = n_ids * (n_ids - 1) / 2;
+    // Position of pair p < q in the upper triangle packed by rows, which is
+    // the same order as the lower triangle packed by columns used by dist
+    auto packed_index = [n_ids](size_t p, size_t q) {
+      return p * n_ids - p * (p + 1) / 2 + (q - p - 1);
+    };
+    const CharacterVector labels = name_strings(names);
+
+    if (format == "matrix") {
+      NumericMatrix out(n_ids, n_ids);
+      double* data = out.begin();
+      triangle_scores(metric, pos, n_threads, [&](size_t p, size_t q, double sim) {
+        data[p * n_ids + q] = sim;
+        data[q * n_ids + p] = sim;
+      });
+      for (size_t p = 0; p < n_ids; p++) {
+        const int count = fp_counts[pos[p]];
+        data[p * n_ids + p] = metric(count, count, count);
+      }
+      out.attr("dimnames") = List::create(labels, labels);
+      return out;
+    }
+
+    RObject out;
+    if (format == "dist") {
+      NumericVector dist(n_pairs);
+      double* data = dist.begin();
+      triangle_scores(metric, pos, n_threads, [&](size_t p, size_t q, double sim) {
+        data[packed_index(p, q)] = Metric::is_distance ? sim : 1 - sim;
+      });
+      dist.attr("Diag") = false;
+      dist.attr("Upper") = false;
+      dist.attr("class") = "dist";
+      out = dist;
+    } else if (format == "packed") {
+      if (precision == "double") {
+        NumericVector packed(n_pairs);
+        double* data = packed.begin();
+        triangle_scores(metric, pos, n_threads, [&](size_t p, size_t q, double sim) {
+          data[packed_index(p, q)] = sim;
+        });
+        out = packed;
+      } else if (precision == "float") {
+        RawVector packed(n_pairs * sizeof(float));
+        float* data = reinterpret_cast<float*>(packed.begin());
+        triangle_scores(metric, pos, n_threads, [&](size_t p, size_t q, double sim) {
+          data[packed_index(p, q)] = static_cast<float>(sim);
+        });
+        out = packed;
+      } else if (precision == "uint16") {
+        // Similarities are scaled to [0, 65535], distances are stored as is.
+        // Undefined similarities of empty fingerprints are stored as 0.
+        const double scale = Metric::is_distance ? 1.0 : 65535.0;
+        RawVector packed(n_pairs * sizeof(std::uint16_t));
+        std::uint16_t* data = reinterpret_cast<std::uint16_t*>(packed.begin());
+        triangle_scores(metric, pos, n_threads, [&](size_t p, size_t q, double sim) {
+          data[packed_index(p, q)] = std::isnan(sim) ? 0 : static_cast<std::uint16_t>(std::lround(sim * scale));
+        });
+        out = packed;
+      } else {
+        stop("Unknown precision '%s'", precision);
+      }
+      out.attr("precision") = precision;
+    } else {
+      stop("Unknown format '%s'", format);
+    }
+    out.attr("Size") = static_cast<int>(n_ids);
+    out.attr("Labels") = labels;
+    return out;
+  }
+
+  // Taylor-Butina clustering. Fingerprints are visited in order of decreasing
+  // number of neighbours above the threshold. Every fingerprint that isn't
+  // assigned yet becomes the centroid of a new cluster together with all of
+  // its unassigned neighbours.
+  template <typename Metric>
+  DataFrame butina_clusters(const Metric& metric, double threshold, int n_threads) {
+    require_fingerprints();
+    check_threshold_search(metric, n_threads);
+    const TriangleTiles tiles(fps.size(), n_threads);
+    std::vector<std::vector<std::pair<std::uint32_t, std::uint32_t>>> pairs(n_threads);
+    threshold_search(
+      metric, threshold, tiles, n_threads,
+      [&](int worker, std::uint32_t i, std::uint32_t j, double sim) {
+        pairs[worker].emplace_back(i, j);
+      },
+      [](size_t tile, int worker) {}
+    );
+    const NeighbourLists neighbours(n(), pairs);
+    pairs.clear();
+    pairs.shrink_to_fit();
+
+    std::vector<std::uint32_t> order(n());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+      return neighbours.degree(a) > neighbours.degree(b);
+    });
+    IntegerVector cluster(n(), 0);
+    LogicalVector centroid(n(), false);
+    int n_clusters = 0;
+    for (auto i: order) {
+      if (cluster[i] != 0)
+        continue;
+      n_clusters++;
+      cluster[i] = n_clusters;
+      centroid[i] = true;
+      for (size_t k = neighbours.offsets[i]; k < neighbours.offsets[i + 1]; k++) {
+        if (cluster[neighbours.ids[k]] == 0)
+          cluster[neighbours.ids[k]] = n_clusters;
+      }
+    }
+    return DataFrame::create(
+      Named("id") = fp_names,
+      Named("cluster") = cluster,
+      Named("centroid") = centroid
+    );
+  }
+
+  // MaxMin diversity picking. Every pick is the fingerprint whose most similar
+  // earlier pick is the least similar. closest[i] holds the rank of the most
+  // similar pick fingerprint i has been compared to and seen[i] the number of
+  // picks it has been compared to. closest[i] can only grow with more picks,
+  // so fingerprints that already rank at least as close as the best candidate
+  // of their chunk are skipped without comparing them to the new picks.
+  template <typename Metric>
+  DataFrame diverse_picks(const Metric& metric, int n_picks, int seed, int n_threads) {
+    require_fingerprints();
+    if (n_picks < 1)
+      stop("Number of picks must be positive");
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+    if (!metric.symmetric())
+      stop("Diversity picking requires a symmetric metric");
+    const size_t n_fps = n();
+    const size_t k = std::min(static_cast<size_t>(n_picks), n_fps);
+    IntegerVector ids(k);
+    NumericVector sims(k);
+    if (k == 0)
+      return DataFrame::create(Named("id") = ids, Named("similarity") = sims);
+
+    // Picked fingerprints rank above everything else and are never picked
+    // again. Undefined similarities of empty fingerprints count as identical.
+    const double picked = std::numeric_limits<double>::infinity();
+    const double undefined = std::numeric_limits<double>::max();
+    std::vector<double> closest(n_fps, -std::numeric_limits<double>::infinity());
+    std::vector<std::uint32_t> seen(n_fps, 0);
+    std::vector<size_t> picks;
+    picks.reserve(k);
+    auto add_pick = [&](size_t i, double rank_i) {
+      ids[picks.size()] = fp_names[i];
+      sims[picks.size()] = rank_i == undefined ? NA_REAL : (Metric::is_distance ? -rank_i : rank_i);
+      closest[i] = picked;
+      picks.push_back(i);
+    };
+    std::mt19937 rng(seed);
+    add_pick(std::uniform_int_distribution<size_t>(0, n_fps - 1)(rng), undefined);
+
+    const size_t chunk_size = std::max<size_t>(4096, n_fps / (4 * n_threads) + 1);
+    const size_t n_chunks = (n_fps + chunk_size - 1) / chunk_size;
+    // Rank and position of the best candidate of every chunk
+    std::vector<std::pair<double, size_t>> chunk_best(n_chunks);
+    const auto count_and = kernels().count_and;
+    while (picks.size() < k) {
+      parallel_for(n_chunks, n_threads, [&](size_t chunk, int worker) {
+        double best = picked;
+        size_t best_i = n_fps;
+        const size_t end = std::min(n_fps, (chunk + 1) * chunk_size);
+        for (size_t i = chunk * chunk_size; i < end; i++) {
+          double c = closest[i];
+          if (c >= best)
+            continue;
+          size_t s = seen[i];
+          for (; s < picks.size() && c < best; s++) {
+            const size_t p = picks[s];
+            const double sim = metric(count_and(fps[i], fps[p]), fp_counts[i], fp_counts[p]);
+            c = std::max(c, std::isnan(sim) ? undefined : rank<Metric>(sim));
+          }
+          closest[i] = c;
+          seen[i] = s;
+          if (c < best) {
+            best = c;
+            best_i = i;
+          }
+        }
+        chunk_best[chunk] = std::make_pair(best, best_i);
+      });
+      // Ties go to the lowest position, independent of the number of threads
+      auto best = chunk_best[0];
+      for (size_t chunk = 1; chunk < n_chunks; chunk++) {
+        if (chunk_best[chunk].first < best.first)
+          best = chunk_best[chunk];
+      }
+      add_pick(best.second, best.first);
+    }
+    return DataFrame::create(
+      Named("id") = ids,
+      Named("similarity") = sims
+    );
+  }
+
+  template <typename Metric>
+  DataFrame subset_scores(const Metric& metric, RObject& x, RObject& y) {
+    auto x_names = convert_sort_name_vec(x);
+    auto x_pos = fp_positions(x_names);
+    std::vector<size_t> y_pos;
+    if (y.isNULL()) {
+      require_fingerprints();
+      y_pos.resize(n());
+      std::iota(y_pos.begin(), y_pos.end(), 0);
+    } else {
+      auto y_names = convert_sort_name_vec(y);
+      y_pos = fp_positions(y_names);
+    }
+    std::vector<Fingerprint> x_fps, y_fps;
+    std::vector<const Fingerprint*> x_pointers, y_pointers;
+    std::vector<int> x_counts, y_counts;
+    subset_fingerprints(x_pos, x_fps, x_pointers, x_counts);
+    subset_fingerprints(y_pos, y_fps, y_pointers, y_counts);
+    const size_t n_y = y_pos.size();
+    const size_t n_total = x_pos.size() * n_y;
+    IntegerVector x_name(n_total);
+    IntegerVector y_name(n_total);
+    NumericVector similarity(n_total);
+    blocked_count_and(
+      x_pointers, y_pointers,
+      [&](size_t i, size_t j, int count_and) {
+        const size_t idx = i * n_y + j;
+        x_name[idx] = fp_names[x_pos[i]];
+        y_name[idx] = fp_names[y_pos[j]];
+        similarity[idx] = metric(count_and, x_counts[i], y_counts[j]);
+      }
+    );
+    return DataFrame::create(
+      Named("id_1") = x_name,
+      Named("id_2") = y_name,
+      Named("similarity") = similarity
+    );
+  }
+
+  template <typename Metric>
+  DataFrame ext_scores(const Metric& metric, const CharacterVector& others) {
+    require_fingerprints();
+    std::vector<FingerprintName> other_names;
+    std::vector<Fingerprint> other_fps;
+    convert_fps<fp_length>(others, other_names, other_fps);
+    std::vector<int> other_counts;
+    std::vector<const Fingerprint*> other_pointers;
+    other_counts.reserve(other_fps.size());
+    other_pointers.reserve(other_fps.size());
+    for (auto& fp: other_fps) {
+      other_counts.push_back(kernels().count(fp));
+      other_pointers.push_back(&fp);
+    }
+    std::vector<size_t> all_pos(n());
+    std::iota(all_pos.begin(), all_pos.end(), 0);
+    const size_t n_other = other_fps.size();
+    size_t nn = n_other * n();
+    IntegerVector id_1(nn);
+    IntegerVector id_2(nn);
+    NumericVector sim(nn);
+    blocked_count_and(
+      other_pointers, fp_pointers(all_pos),
+      [&](size_t j, size_t i, int count_and) {
+        const size_t idx = i * n_other + j;
+        sim[idx] = metric(count_and, other_counts[j], fp_counts[i]);
+        id_1[idx] = other_names[j];
+        id_2[idx] = fp_names[i];
+      }
+    );
+    return DataFrame::create(
+      Named("id_1") = id_1,
+      Named("id_2") = id_2,
+      Named("similarity") = sim
+    );
+  }
+
+  template <typename Metric>
+  DataFrame ext_scores(const Metric& metric, const CharacterVector& others, double threshold) {
+    require_fingerprints();
+    std::vector<FingerprintName> other_names;
+    std::vector<Fingerprint> other_fps;
+    convert_fps<fp_length>(others, other_names, other_fps);
+    const auto count = kernels().count;
+    // Hits as (position in collection, index of external drug, similarity)
+    std::vector<std::tuple<size_t, size_t, double>> hits;
+    for (size_t j = 0; j < other_fps.size(); j++) {
+      for (auto& hit: window_search(metric, other_fps[j], count(other_fps[j]), threshold))
+        hits.emplace_back(hit.first, j, hit.second);
+    }
+    std::sort(hits.begin(), hits.end());
+    IntegerVector id_1(hits.size());
+    IntegerVector id_2(hits.size());
+    NumericVector sim(hits.size());
+    for (size_t idx = 0; idx < hits.size(); idx++) {
+      id_1[idx] = other_names[std::get<1>(hits[idx])];
+      id_2[idx] = fp_names[std::get<0>(hits[idx])];
+      sim[idx] = std::get<2>(hits[idx]);
+    }
+    return DataFrame::create(
+      Named("id_1") = id_1,
+      Named("id_2") = id_2,
+      Named("similarity") = sim
+    );
+  }
+
+  template <typename Metric>
+  DataFrame topk_scores(const Metric& metric, const CharacterVector& others, int k, int n_threads) {
+    require_fingerprints();
+    if (k < 1)
+      stop("k must be positive");
+    std::vector<FingerprintName> other_names;
+    std::vector<Fingerprint> other_fps;
+    convert_fps<fp_length>(others, other_names, other_fps);
+    const size_t kk = std::min(static_cast<size_t>(k), n());
+    const auto count = kernels().count;
+    std::vector<std::vector<std::pair<size_t, double>>> hits(other_fps.size());
+    parallel_for(other_fps.size(), n_threads, [&](size_t j, int worker) {
+      hits[j] = topk_search(metric, other_fps[j], count(other_fps[j]), kk);
+    });
+    size_t nn = 0;
+    for (auto& h: hits)
+      nn += h.size();
+    IntegerVector id_1(nn);
+    IntegerVector id_2(nn);
+    NumericVector sim(nn);
+    size_t idx = 0;
+    for (size_t j = 0; j < hits.size(); j++) {
+      for (auto& hit: hits[j]) {
+        id_1[idx] = other_names[j];
+        id_2[idx] = fp_names[hit.first];
+        sim[idx] = hit.second;
+        idx++;
+      }
+    }
+    return DataFrame::create(
+      Named("id_1") = id_1,
+      Named("id_2") = id_2,
+      Named("similarity") = sim
+    );
+  }
+
+  // Candidates of the LSH index are verified with the exact metric, so only
+  // fingerprints missed by the index are lost
+  template <typename Metric>
+  DataFrame lsh_scores(const Metric& metric, const CharacterVector& others, double threshold, int n_threads) {
+    if (lsh.empty())
+      stop("No LSH index, build one using build_lsh() or load it using load_lsh()");
+    std::vector<FingerprintName> other_names;
+    std::vector<Fingerprint> other_fps;
+    convert_fps<fp_length>(others, other_names, other_fps);
+    const auto count = kernels().count;
+    const auto count_and = kernels().count_and;
+    const double min_rank = rank<Metric>(threshold);
+    std::vector<std::vector<std::pair<size_t, double>>> hits(other_fps.size());
+    parallel_for(other_fps.size(), n_threads, [&](size_t j, int worker) {
+      const Fingerprint& fp = other_fps[j];
+      const int count_j = count(fp);
+      for (auto i: lsh.candidates(fp)) {
+        const double sim = metric(count_and(fp, fps[i]), count_j, fp_counts[i]);
+        if (rank<Metric>(sim) > min_rank)
+          hits[j].emplace_back(i, sim);
+      }
+    });
+    size_t nn = 0;
+    for (auto& h: hits)
+      nn += h.size();
+    IntegerVector id_1(nn);
+    IntegerVector id_2(nn);
+    NumericVector sim(nn);
+    size_t idx = 0;
+    for (size_t j = 0; j < hits.size(); j++) {
+      for (auto& hit: hits[j]) {
+        id_1[idx] = other_names[j];
+        id_2[idx] = fp_names[hit.first];
+        sim[idx] = hit.second;
+        idx++;
+      }
+    }
+    return DataFrame::create(
+      Named("id_1") = id_1,
+      Named("id_2") = id_2,
+      Named("similarity") = sim
+    );
+  }
+
+  // All pairs of fingerprints with similarity above the threshold, collected
+  // in per worker buffers
+  template <typename Metric>
+  TiledPairs threshold_pairs(const Metric& metric, double threshold, int n_threads) {
+    check_threshold_search(metric, n_threads);
+    const TriangleTiles tiles(fps.size(), n_threads);
+    TiledPairs hits(tiles.size(), n_threads, 1 << 16);
+    std::vector<size_t> tile_begin(n_threads, 0);
+    threshold_search(
+      metric, threshold, tiles, n_threads,
+      [&](int worker, std::uint32_t i, std::uint32_t j, double sim) {
+        hits.buffers[worker].push_back(i, j, sim);
+      },
+      [&](size_t tile, int worker) {
+        const size_t end = hits.buffers[worker].size();
+        hits.segments[tile] = TiledPairs::Segment{worker, tile_begin[worker], end};
+        tile_begin[worker] = end;
+      }
+    );
+    return hits;
+  }
+
+  template <typename Metric>
+  void check_threshold_search(const Metric& metric, int n_threads) {
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+    if (!metric.symmetric())
+      stop("Searches over all pairs require a symmetric metric");
+    if (fps.size() > UINT32_MAX)
+      stop("Too many fingerprints for pairwise search");
+  }
+
+  // Search all pairs of fingerprints with similarity above the threshold. The
+  // upper triangle of the fingerprints ordered by popcount is split into tiles
+  // that are distributed over n_threads workers. Every row only visits the
+  // columns up to the largest popcount that can still reach the threshold.
+  // Calls hit(worker, i, j, similarity) with i < j for every pair and
+  // tile_done(tile, worker) once a tile is finished, both on the worker thread.
+  template <typename Metric, typename Hit, typename TileDone>
+  void threshold_search(
+      const Metric& metric, double threshold, const TriangleTiles& tiles,
+      int n_threads, Hit hit, TileDone tile_done
+  ) {
+    const double min_rank = rank<Metric>(threshold);
+    std::vector<size_t> window_end(n_bits + 1);
+    for (int c = 0; c <= n_bits; c++)
+      window_end[c] = count_window(metric, c, threshold).second;
+    const auto count_and = kernels().count_and;
+    with_prefilter([&](const auto& prefilter) {
+      parallel_for(tiles.size(), n_threads, [&](size_t tile, int worker) {
+        const size_t col_begin = tiles.col_begin(tile);
+        const size_t col_end = tiles.col_end(tile);
+        for (size_t p = tiles.row_begin(tile); p < tiles.row_end(tile); p++) {
+          const std::uint32_t i = count_order[p];
+          const Fingerprint& fp_i = fps[i];
+          const int count_i = fp_counts[i];
+          const auto summary_i = prefilter.summary(i);
+          const size_t end = std::min(col_end, window_end[count_i]);
+          for (size_t q = std::max(p + 1, col_begin); q < end; q++) {
+            const std::uint32_t j = count_order[q];
+            if (prefilter.enabled && !(rank<Metric>(metric(
+                prefilter.shared_bound(summary_i, count_i, j, fp_counts[j]),
+                count_i, fp_counts[j])) > min_rank))
+              continue;
+            const double sim = metric(count_and(fp_i, fps[j]), count_i, fp_counts[j]);
+            if (rank<Metric>(sim) > min_rank)
+              hit(worker, std::min(i, j), std::max(i, j), sim);
+          }
+        }
+        tile_done(tile, worker);
+      });
+    });
+  }
+
+  // Range of positions in count_order of all fingerprints that can reach a
+  // similarity above the threshold with a query with count bits set. The
+  // bound of every metric is largest for targets with the same popcount as
+  // the query and decreases on both sides, e.g. Tanimoto similarity is
+  // bounded by min(a, b) / max(a, b) (Swamidass & Baldi 2007).
+  template <typename Metric>
+  std::pair<size_t, size_t> count_window(const Metric& metric, int count, double threshold) {
+    const double min_rank = rank<Metric>(threshold);
+    int lo = -1, hi = -1;
+    for (int c = 0; c <= n_bits; c++) {
+      if (rank_bound(metric, count, c) > min_rank) {
+        if (lo < 0)
+          lo = c;
+        hi = c;
+      }
+    }
+    if (lo < 0)
+      return std::make_pair(0, 0);
+    return std::make_pair(count_offsets[lo], count_offsets[hi + 1]);
+  }
+
+  // Positions and similarity of all fingerprints in the collection with
+  // similarity above the threshold to the given fingerprint, ordered by position
+  template <typename Metric>
+  std::vector<std::pair<size_t, double>> window_search(
+      const Metric& metric, const Fingerprint& fp, int count, double threshold
+  ) {
+    const auto count_and = kernels().count_and;
+    const double min_rank = rank<Metric>(threshold);
+    std::vector<std::pair<size_t, double>> hits;
+    auto window = count_window(metric, count, threshold);
+    if (!bitslices.empty() && window.first < window.second) {
+      // Fewest shared bits a target with c bits set needs to pass the
+      // threshold, more than it has if it can't
+      std::vector<int> needed(n_bits + 1);
+      const int c_first = fp_counts[count_order[window.first]];
+      const int c_last = fp_counts[count_order[window.second - 1]];
+      for (int c = c_first; c <= c_last; c++) {
+        int shared = 0;
+        while (shared <= std::min(count, c) && !(rank<Metric>(metric(shared, count, c)) > min_rank))
+          shared++;
+        needed[c] = shared;
+      }
+      sliced_count_and(fp, window.first, window.second,
+        [&](size_t p_begin, size_t p_end) {
+          const int c_begin = fp_counts[count_order[p_begin]];
+          const int c_end = fp_counts[count_order[p_end - 1]];
+          return *std::min_element(&needed[c_begin], &needed[c_end] + 1);
+        },
+        [&](size_t p, int count_and) {
+          const std::uint32_t i = count_order[p];
+          const double sim = metric(count_and, count, fp_counts[i]);
+          if (rank<Metric>(sim) > min_rank)
+            hits.emplace_back(i, sim);
+        }
+      );
+      std::sort(hits.begin(), hits.end());
+      return hits;
+    }
+    with_prefilter([&](const auto& prefilter) {
+      const auto summary = prefilter.fold(fp);
+      for (size_t p = window.first; p < window.second; p++) {
+        const std::uint32_t i = count_order[p];
+        if (prefilter.enabled && !(rank<Metric>(metric(
+            prefilter.shared_bound(summary, count, i, fp_counts[i]),
+            count, fp_counts[i])) > min_rank))
+          continue;
+        const double sim = metric(count_and(fp, fps[i]), count, fp_counts[i]);
+        if (rank<Metric>(sim) > min_rank)
+          hits.emplace_back(i, sim);
+      }
+    });
+    std::sort(hits.begin(), hits.end());
+    return hits;
+  }
+
+  // The k fingerprints most similar to the given one, ordered by decreasing
+  // similarity and position. Popcount buckets are visited in order of their
+  // similarity bound, starting from the popcount of the query and moving
+  // outwards, until no remaining bucket can beat the k-th best hit so far.
+  template <typename Metric>
+  std::vector<std::pair<size_t, double>> topk_search(
+      const Metric& metric, const Fingerprint& fp, int count, size_t k
+  ) {
+    using Hit = std::pair<size_t, double>;
+    auto better = [](const Hit& a, const Hit& b) {
+      const double rank_a = rank<Metric>(a.second), rank_b = rank<Metric>(b.second);
+      return rank_a > rank_b || (rank_a == rank_b && a.first < b.first);
+    };
+    // Bounded heap with the worst of the k best hits on top
+    std::priority_queue<Hit, std::vector<Hit>, decltype(better)> heap(better);
+    const auto count_and = kernels().count_and;
+    const double no_bound = -std::numeric_limits<double>::infinity();
+    with_prefilter([&](const auto& prefilter) {
+      const auto summary = prefilter.fold(fp);
+      int below = count - 1, above = count;
+      while (below >= 0 || above <= n_bits) {
+        const double bound_below = below >= 0 ? rank_bound(metric, count, below) : no_bound;
+        const double bound_above = above <= n_bits ? rank_bound(metric, count, above) : no_bound;
+        const int c = above <= n_bits && (below < 0 || bound_above >= bound_below) ? above++ : below--;
+        if (heap.size() == k && std::max(bound_below, bound_above) < rank<Metric>(heap.top().second))
+          break;
+        for (size_t p = count_offsets[c]; p < count_offsets[c + 1]; p++) {
+          const std::uint32_t i = count_order[p];
+          // Targets that can at best tie with the worst hit are still
+          // compared, they win ties with a lower position
+          if (prefilter.enabled && heap.size() == k && rank<Metric>(metric(
+              prefilter.shared_bound(summary, count, i, fp_counts[i]),
+              count, fp_counts[i])) < rank<Metric>(heap.top().second))
+            continue;
+          const Hit hit(i, metric(count_and(fp, fps[i]), count, fp_counts[i]));
+          if (std::isnan(hit.second))
+            continue;
+          if (heap.size() < k) {
+            heap.push(hit);
+          } else if (better(hit, heap.top())) {
+            heap.pop();
+            heap.push(hit);
+          }
+        }
+      }
+    });
+    std::vector<Hit> hits;
+    hits.reserve(heap.size());
+    while (!heap.empty()) {
+      hits.push_back(heap.top());
+      heap.pop();
+    }
+    std::reverse(hits.begin(), hits.end());
+    return hits;
+  }
+
+  // Positions of all fingerprints that have every bit of fp set, in
+  // increasing order. Candidates are the posting list of the rarest bit of
+  // fp, intersected with the lists of the next rarest bits. Bits beyond
+  // those rarely remove many candidates, so the remaining ones are checked
+  // against the full fingerprint instead.
+  std::vector<std::uint32_t> superset_search(const Fingerprint& fp, int count) {
+    const size_t max_lists = 4;
+    std::vector<std::uint32_t> hits;
+    if (count == 0) {
+      hits.resize(fps.size());
+      std::iota(hits.begin(), hits.end(), 0);
+      return hits;
+    }
+    std::vector<size_t> bits;
+    bits.reserve(count);
+    for (size_t w = 0; w < fp.size(); w++) {
+      for (std::uint64_t x = fp[w]; x != 0; x &= x - 1)
+        bits.push_back(w * 64 + __builtin_ctzll(x));
+    }
+    std::sort(bits.begin(), bits.end(), [&](size_t a, size_t b) {
+      return postings.length(a) < postings.length(b);
+    });
+    hits.assign(postings.begin(bits[0]), postings.end(bits[0]));
+    for (size_t k = 1; k < std::min(bits.size(), max_lists) && !hits.empty(); k++) {
+      const std::uint32_t* first = postings.begin(bits[k]);
+      const std::uint32_t* last = postings.end(bits[k]);
+      size_t kept = 0;
+      for (auto i: hits) {
+        first = std::lower_bound(first, last, i);
+        if (first == last)
+          break;
+        if (*first == i)
+          hits[kept++] = i;
+      }
+      hits.resize(kept);
+    }
+    if (bits.size() > max_lists) {
+      const auto count_and = kernels().count_and;
+      hits.erase(std::remove_if(hits.begin(), hits.end(), [&](std::uint32_t i) {
+        return count_and(fp, fps[i]) != count;
+      }), hits.end());
+    }
+    return hits;
+  }
+
+  // Read all fingerprints of a lazily loaded collection, for methods that
+  // need more than a few of them
+  void require_fingerprints() {
+    if (lazy.empty())
+      return;
+    const std::string path = lazy.path();
+    lazy.close();
+    read_file(path);
+    count_bits();
+  }
+
+  // Pointers to and counts of the fingerprints at the given positions. A
+  // lazily loaded collection reads them into buffer.
+  void subset_fingerprints(
+      const std::vector<size_t>& positions, std::vector<Fingerprint>& buffer,
+      std::vector<const Fingerprint*>& pointers, std::vector<int>& counts
+  ) {
+    if (lazy.empty()) {
+      pointers = fp_pointers(positions);
+      counts.clear();
+      for (auto p: positions)
+        counts.push_back(fp_counts[p]);
+      return;
+    }
+    buffer = lazy.fetch(positions);
+    pointers.clear();
+    counts.clear();
+    for (auto& fp: buffer) {
+      pointers.push_back(&fp);
+      counts.push_back(kernels().count(fp));
+    }
+  }
+
+  // Count bits of every fingerprint, unless they were read from a file in
+  // mapped format, and order them by their counts
+  void count_bits() {
+    const auto count = kernels().count;
+    if (fp_counts.size() != fps.size()) {
+      fp_counts.resize(fps.size());
+      for (size_t i = 0; i < fps.size(); i++)
+        fp_counts[i] = count(fps[i]);
+    }
+    count_offsets.assign(n_bits + 2, 0);
+    for (auto c: fp_counts)
+      count_offsets[c + 1]++;
+    std::partial_sum(count_offsets.begin(), count_offsets.end(), count_offsets.begin());
+    count_order.resize(fps.size());
+    std::vector<size_t> next(count_offsets.begin(), count_offsets.end() - 1);
+    for (size_t i = 0; i < fps.size(); i++)
+      count_order[next[fp_counts[i]]++] = i;
+  }
+
+  std::vector<const Fingerprint*> fp_pointers(const std::vector<size_t>& positions) {
+    std::vector<const Fingerprint*> pointers;
+    pointers.reserve(positions.size());
+    for (auto i: positions)
+      pointers.push_back(&fps[i]);
+    return pointers;
+  }
+
+  // Fingerprint names as strings, used as dimnames
+  static CharacterVector name_strings(const std::vector<FingerprintName>& names) {
+    CharacterVector out(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+      out[i] = std::to_string(names[i]);
+    return out;
+  }
+
+  size_t fp_position(RObject& x) {
+    FingerprintName x_name = convert_name(x);
+    auto fp_pt = std::lower_bound(fp_names.begin(), fp_names.end(), x_name);
+    if (fp_pt == fp_names.end() || *fp_pt != x_name)
+      stop("Fingerprint %i not found", x_name);
+    return fp_pt - fp_names.begin();
+  }
+
+  // Positions of a sorted vector of names
+  std::vector<size_t> fp_positions(std::vector<FingerprintName>& names) {
+    std::vector<size_t> hits;
+    hits.reserve(names.size());
+    auto last_idx = fp_names.begin();
+    std::vector<FingerprintName>::iterator cur_idx;
+    for (auto x: names) {
+      cur_idx = std::lower_bound(last_idx, fp_names.end(), x);
+      if (cur_idx == fp_names.end() || *cur_idx != x)
+        stop("Fingerprint %i not found", x);
+      hits.push_back(cur_idx - fp_names.begin());
+      last_idx = cur_idx;
+    }
+    return hits;
+  }
+
+  // Use the fingerprints of a file in mapped format in place. Only the names
+  // and popcounts are copied, after checking that the counts are valid and the
+  // names sorted, as both are used as indices without further checks.
+  void map_file(const std::string& filename) {
+    auto file = std::make_shared<const MappedFile>(filename);
+    if (file->size() < MappedLayout::header_size)
+      stop("File %s is truncated", filename);
+    std::uint32_t version, length;
+    FingerprintN n;
+    std::memcpy(&version, file->data() + 9, sizeof(version));
+    std::memcpy(&length, file->data() + 13, sizeof(length));
+    std::memcpy(&n, file->data() + 17, sizeof(n));
+    if (version != MappedLayout::version)
+      stop("Unsupported file format version %i", version);
+    if (length != fp_length)
+      stop("File holds fingerprints of %i bits, expected %i", length, static_cast<int>(fp_length));
+    // Bound n by the file size first, so that the layout can't overflow
+    const size_t bytes_per_fp = sizeof(std::int32_t) + sizeof(Fingerprint) + sizeof(FingerprintName);
+    if (n > (file->size() - MappedLayout::header_size) / bytes_per_fp)
+      stop("File %s is truncated", filename);
+    const MappedLayout layout(n);
+    if (file->size() < layout.end)
+      stop("File %s is truncated", filename);
+    const std::int32_t* counts = reinterpret_cast<const std::int32_t*>(file->data() + layout.counts);
+    const FingerprintName* names = reinterpret_cast<const FingerprintName*>(file->data() + layout.names);
+    for (size_t i = 0; i < n; i++) {
+      if (counts[i] < 0 || counts[i] > static_cast<std::int32_t>(fp_length))
+        stop("File %s is inconsistent", filename);
+      if (i > 0 && names[i] <= names[i - 1])
+        stop("File %s is inconsistent", filename);
+    }
+    fp_counts.assign(counts, counts + n);
+    fp_names.assign(names, names + n);
+    fps.map(file, layout.fingerprints, n);
+  }
+
+  void check_save_options(int compression_level, int n_threads) {
+    if (compression_level < 1 || compression_level > 22)
+      stop("Compression level must be between 0 and 22. Default = 3");
+    if (n_threads < 1)
+      stop("Number of threads must be positive");
+  }
+
+  // Segment of a saved file: the number of fingerprints, a ChunkTable, the
+  // chunks of file_chunk_size fingerprints, each its own zstd frame, and the
+  // names as a single block. Names are sorted within a segment.
+  void write_segment(std::ofstream& out_stream, int compression_level, int n_threads, bool long_distance) {
+    const FingerprintN n = fps.size();
+    out_stream.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    const std::uint64_t chunk_size = file_chunk_size;
+    const std::uint64_t n_chunks = (n + chunk_size - 1) / chunk_size;
+    out_stream.write(reinterpret_cast<const char*>(&chunk_size), sizeof(chunk_size));
+    out_stream.write(reinterpret_cast<const char*>(&n_chunks), sizeof(n_chunks));
+    // The table is filled in once all chunks are written
+    const std::streampos table_pos = out_stream.tellp();
+    std::vector<std::uint64_t> chunk_sizes(n_chunks, 0);
+    out_stream.write(reinterpret_cast<const char*>(chunk_sizes.data()), n_chunks * sizeof(std::uint64_t));
+
+    // Chunks are compressed in batches of one per thread and written in
+    // order, so at most a batch of compressed chunks is held in memory
+    std::vector<std::unique_ptr<ChunkCompressor>> compressors;
+    for (size_t k = 0; k < std::min<size_t>(n_threads, n_chunks); k++)
+      compressors.emplace_back(new ChunkCompressor(compression_level, long_distance));
+    std::uint64_t fingerprints_compressed = 0;
+    for (size_t batch = 0; batch < n_chunks; batch += compressors.size()) {
+      const size_t batch_end = std::min<size_t>(n_chunks, batch + compressors.size());
+      parallel_for(batch_end - batch, n_threads, [&](size_t k, int worker) {
+        const size_t begin = (batch + k) * chunk_size;
+        const size_t end = std::min<size_t>(n, begin + chunk_size);
+        chunk_sizes[batch + k] = compressors[k]->compress(
+          reinterpret_cast<const char*>(fps.data() + begin),
+          (end - begin) * sizeof(Fingerprint)
+        );
+      });
+      for (size_t c = batch; c < batch_end; c++) {
+        out_stream.write(compressors[c - batch]->data(), chunk_sizes[c]);
+        fingerprints_compressed += chunk_sizes[c];
+      }
+    }
+    Rcout << "Fingerprints compressed " << fingerprints_compressed << " bytes\n";
+
+    const std::streampos names_pos = out_stream.tellp();
+    out_stream.seekp(table_pos);
+    out_stream.write(reinterpret_cast<const char*>(chunk_sizes.data()), n_chunks * sizeof(std::uint64_t));
+    out_stream.seekp(names_pos);
+    Rcout << "Wrote fingerprints\n";
+
+    zstd_write_block(
+      out_stream, reinterpret_cast<const char*>(fp_names.data()),
+      fp_names.size() * sizeof(FingerprintName), compression_level
+    );
+    Rcout << "Wrote Names\n";
+  }
+
+  // Fingerprints per independently compressed chunk of a saved file
+  static const size_t file_chunk_size = 65536;
+
+  // Read the chunks of all segments, already located by read_segments(), in
+  // parallel. Chunks are decompressed straight into fps, which must already
+  // have its final size, unless the segments were merged. Then every chunk
+  // is decompressed into a buffer and its fingerprints moved to their merged
+  // positions.
+  void read_chunks(
+      std::ifstream& in_stream, const std::vector<ChunkTable>& segments,
+      const std::vector<size_t>& order
+  ) {
+    std::vector<size_t> merged_position;
+    if (!order.empty()) {
+      merged_position.resize(order.size());
+      for (size_t p = 0; p < order.size(); p++)
+        merged_position[order[p]] = p;
+    }
+    Fingerprint* out = fps.mutable_data();
+    size_t segment_begin = 0;
+    for (auto& table: segments) {
+      Rcout << "Fingerprint chunks have " << table.offsets.back() << " bytes\n";
+      std::vector<char> compressed(table.offsets.back());
+      in_stream.clear();
+      in_stream.seekg(table.start);
+      in_stream.read(compressed.data(), compressed.size());
+      if (!in_stream)
+        stop("File is truncated");
+      parallel_for(table.n_chunks(), default_n_threads(), [&](size_t c, int worker) {
+        const size_t begin = segment_begin + c * table.chunk_size;
+        const size_t end = std::min<size_t>(segment_begin + table.n, begin + table.chunk_size);
+        if (order.empty()) {
+          zstd_decompress_chunk(
+            compressed.data() + table.offsets[c], table.sizes[c],
+            reinterpret_cast<char*>(out + begin), (end - begin) * sizeof(Fingerprint)
+          );
+          return;
+        }
+        std::vector<Fingerprint> buffer(end - begin);
+        zstd_decompress_chunk(
+          compressed.data() + table.offsets[c], table.sizes[c],
+          reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(Fingerprint)
+        );
+        for (size_t k = 0; k < buffer.size(); k++)
+          out[merged_position[begin + k]] = buffer[k];
+      });
+      segment_begin += table.n;
+    }
+  }
+
+  // Offset of the number of fingerprints in the header of a saved file,
+  // after the magic, format version and fingerprint length
+  static const std::streamoff count_offset = 17;
+
+  // Check the magic, format version and fingerprint length of a saved file,
+  // returns the version, 0 for files starting with "MORGANFPS"
+  std::uint32_t read_header(std::ifstream& in_stream) {
+    char magic[] = "xORGANFPS";
+    in_stream.read(magic, 9);
+    std::uint32_t length = 2048;
+    std::uint32_t version = 0;
+    if (strcmp(magic, "MORGANFPX") == 0) {
+      in_stream.read(reinterpret_cast<char*>(&version), sizeof(version));
+      if (version < 1 || version > 3)
+        stop("Unsupported file format version %i", version);
+      in_stream.read(reinterpret_cast<char*>(&length), sizeof(length));
+    } else if (strcmp(magic, "MORGANFPS") != 0) {
+      stop("File is incompatible, doesn't start with 'MORGANFPX' or 'MORGANFPS': '%s'", magic);
+    }
+    if (length != fp_length)
+      stop("File holds fingerprints of %i bits, expected %i", length, static_cast<int>(fp_length));
+    return version;
+  }
+
+  // Read the chunk tables and names of the segments of a version 2 or 3
+  // file holding n fingerprints, skipping over the chunks. Names are stored
+  // in file order, chunk tables are added to tables unless it's null.
+  void read_segments(
+      std::ifstream& in_stream, std::uint32_t version, size_t n, size_t n_segments,
+      FingerprintName* names, std::vector<ChunkTable>* tables
+  ) {
+    size_t offset = 0;
+    for (size_t s = 0; s < n_segments; s++) {
+      FingerprintN segment_n = n;
+      if (version == 3)
+        in_stream.read(reinterpret_cast<char*>(&segment_n), sizeof(segment_n));
+      if (!in_stream || segment_n > n - offset)
+        stop("Segments don't match the number of fingerprints");
+      ChunkTable table;
+      table.read(in_stream, segment_n);
+      in_stream.seekg(table.start + static_cast<std::streamoff>(table.offsets.back()));
+      zstd_read_block(
+        in_stream, reinterpret_cast<char*>(names + offset), segment_n * sizeof(FingerprintName)
+      );
+      offset += segment_n;
+      if (tables != nullptr)
+        tables->push_back(table);
+    }
+    if (offset != n)
+      stop("Segments don't match the number of fingerprints");
+  }
+
+  // Sort the names of a file with several segments, each sorted on its own.
+  // Returns the file position of the fingerprint at every sorted position,
+  // or nothing if the names are in order already, as when names of appended
+  // fingerprints keep increasing.
+  std::vector<size_t> merge_segments() {
+    std::vector<size_t> order;
+    if (!std::is_sorted(fp_names.begin(), fp_names.end())) {
+      order.resize(fp_names.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return fp_names[a] < fp_names[b];
+      });
+      std::vector<FingerprintName> sorted(fp_names.size());
+      for (size_t p = 0; p < order.size(); p++)
+        sorted[p] = fp_names[order[p]];
+      fp_names.swap(sorted);
+    }
+    if (std::adjacent_find(fp_names.begin(), fp_names.end()) != fp_names.end())
+      stop("Duplicate names are not allowed");
+    return order;
+  }
+  // Sections of a file in mapped format: a header with "MORGANMAP", the
+  // format version, the fingerprint length and number, followed by the
+  // popcounts, fingerprints and names, each starting at a multiple of 64
+  // bytes
+  struct MappedLayout {
+    static const size_t header_size = 64;
+    static const std::uint32_t version = 1;
+    size_t counts, fingerprints, names, end;
+
+    explicit MappedLayout(size_t n) {
+      counts = header_size;
+      fingerprints = align(counts + n * sizeof(std::int32_t));
+      names = align(fingerprints + n * sizeof(Fingerprint));
+      end = names + n * sizeof(FingerprintName);
+    }
+
+    static size_t align(size_t offset) {
+      return (offset + 63) / 64 * 64;
+    }
+  };
+
+  // Files in chunked format can be opened on_demand, reading only the names
+  // and chunk tables up front
+  void read_file(std::string filename, bool on_demand = false) {
+    std::ifstream in_stream;
+    in_stream.open(filename, std::ios::in | std::ios::binary);
+
+    char magic[] = "xORGANFPS";
+    in_stream.read(magic, 9);
+    if (strcmp(magic, "MORGANMAP") == 0) {
+      in_stream.close();
+      map_file(filename);
+      return;
+    }
+    in_stream.clear();
+    in_stream.seekg(0);
+    const std::uint32_t version = read_header(in_stream);
+    if (on_demand && version < 2)
+      stop("Only files saved by save_file() of this version can be loaded lazily");
 
     FingerprintN n;
     in_stream.read(reinterpret_cast<char*>(&n), sizeof(FingerprintN));
     Rcout << "Reading " << n << " fingerprints from file\n";
-    fps.resize(n);
     fp_names.resize(n);
 
+    if (version >= 2) {
+      std::uint64_t n_segments = 1;
+      if (version == 3)
+        in_stream.read(reinterpret_cast<char*>(&n_segments), sizeof(n_segments));
+      if (!in_stream)
+        stop("File is truncated");
+      std::vector<ChunkTable> segments;
+      read_segments(in_stream, version, n, n_segments, fp_names.data(), &segments);
+      Rcout << "Names decompressed\n";
+      const std::vector<size_t> order = merge_segments();
+      if (on_demand) {
+        lazy.open(filename, segments, order);
+      } else {
+        fps.resize(n);
+        read_chunks(in_stream, segments, order);
+        Rcout << "Fingerprints decompressed\n";
+      }
+      return;
+    }
+
+    fps.resize(n);
     size_t size_next_block;
     in_stream.read(reinterpret_cast<char*>(&size_next_block), sizeof(size_t));
     Rcout << "Fingerprint block has " << size_next_block << " bytes\n";
@@ -381,13 +2417,15 @@ private:
     size_t expected_decompressed_size = fps.size() * sizeof(Fingerprint);
 
     zstd_frame_decompress(
-      in_stream, size_next_block, reinterpret_cast<char*>(fps.data()),
+      in_stream, size_next_block, reinterpret_cast<char*>(fps.mutable_data()),
       expected_decompressed_size
     );
 
     Rcout << "Fingerprints decompressed\n";
 
     in_stream.read(reinterpret_cast<char*>(&size_next_block), sizeof(size_t));
+    if (!in_stream)
+      stop("File is truncated");
     Rcout << "Names block has " << size_next_block << " bytes\n";
 
     expected_decompressed_size = fp_names.size() * sizeof(FingerprintName);
@@ -399,7 +2437,6 @@ private:
 
     Rcout << "Names decompressed\n";
   }
-
 };
 
 // https://stackoverflow.com/a/42585733/4603385
@@ -408,25 +2445,126 @@ bool typed_valid(SEXP* args, int nargs){
   return nargs == 2 && is<T0>(args[0]) && is<T1>(args[1]);
 }
 
+// Overloads with the same number of arguments are told apart by whether the
+// last argument is a metric
+template <int N>
+bool metric_valid(SEXP* args, int nargs){
+  return nargs == N && is<CharacterVector>(args[N - 1]);
+}
+
+template <int N>
+bool no_metric_valid(SEXP* args, int nargs){
+  return nargs == N && !is<CharacterVector>(args[N - 1]);
+}
+
+using MorganFPS = FingerprintCollection<2048>;
+using MorganFPS1024 = FingerprintCollection<1024>;
+using MorganFPS4096 = FingerprintCollection<4096>;
+using MACCSFPS = FingerprintCollection<167>;
+
+// Register the collection for one fingerprint length with the current module
+template <size_t fp_length>
+void expose_collection(const char* name) {
+  using FPS = FingerprintCollection<fp_length>;
+  class_<FPS>(name)
+    .template constructor<CharacterVector>("Construct fingerprint collection from character vector")
+    .template constructor<std::string, bool>("Construct fingerprint collection from binary file", &typed_valid<std::string, bool>)
+    .template constructor<std::string, bool, bool>("Construct fingerprint collection reading a binary file on demand")
+    .method("size", &FPS::size)
+    .method("page_size", &FPS::page_size)
+    .method("n", &FPS::n)
+    .method("tanimoto", (double (FPS::*)(RObject&, RObject&)) (&FPS::tanimoto))
+    .method("tanimoto", (double (FPS::*)(RObject&, RObject&, const CharacterVector&)) (&FPS::tanimoto))
+    .method("tanimoto_all", (DataFrame (FPS::*)(RObject&)) (&FPS::tanimoto_all))
+    .method("tanimoto_all", (DataFrame (FPS::*)(RObject&, double)) (&FPS::tanimoto_all), 0, &no_metric_valid<2>)
+    .method("tanimoto_all", (DataFrame (FPS::*)(RObject&, const CharacterVector&)) (&FPS::tanimoto_all), 0, &metric_valid<2>)
+    .method("tanimoto_all", (DataFrame (FPS::*)(RObject&, double, const CharacterVector&)) (&FPS::tanimoto_all))
+    .method("tanimoto_threshold", (DataFrame (FPS::*)(double)) (&FPS::tanimoto_threshold))
+    .method("tanimoto_threshold", (DataFrame (FPS::*)(double, int)) (&FPS::tanimoto_threshold), 0, &no_metric_valid<2>)
+    .method("tanimoto_threshold", (DataFrame (FPS::*)(double, const CharacterVector&)) (&FPS::tanimoto_threshold), 0, &metric_valid<2>)
+    .method("tanimoto_threshold", (DataFrame (FPS::*)(double, int, const CharacterVector&)) (&FPS::tanimoto_threshold))
+    .method("tanimoto_threshold_file", (List (FPS::*)(double, const std::string&)) (&FPS::tanimoto_threshold_file))
+    .method("tanimoto_threshold_file", (List (FPS::*)(double, const std::string&, int)) (&FPS::tanimoto_threshold_file), 0, &no_metric_valid<3>)
+    .method("tanimoto_threshold_file", (List (FPS::*)(double, const std::string&, const CharacterVector&)) (&FPS::tanimoto_threshold_file), 0, &metric_valid<3>)
+    .method("tanimoto_threshold_file", (List (FPS::*)(double, const std::string&, int, const CharacterVector&)) (&FPS::tanimoto_threshold_file))
+    .method("tanimoto_threshold_sparse", (S4 (FPS::*)(double)) (&FPS::tanimoto_threshold_sparse))
+    .method("tanimoto_threshold_sparse", (S4 (FPS::*)(double, int)) (&FPS::tanimoto_threshold_sparse), 0, &no_metric_valid<2>)
+    .method("tanimoto_threshold_sparse", (S4 (FPS::*)(double, const CharacterVector&)) (&FPS::tanimoto_threshold_sparse), 0, &metric_valid<2>)
+    .method("tanimoto_threshold_sparse", (S4 (FPS::*)(double, int, const CharacterVector&)) (&FPS::tanimoto_threshold_sparse))
+    .method("cluster_butina", (DataFrame (FPS::*)(double)) (&FPS::cluster_butina))
+    .method("cluster_butina", (DataFrame (FPS::*)(double, int)) (&FPS::cluster_butina), 0, &no_metric_valid<2>)
+    .method("cluster_butina", (DataFrame (FPS::*)(double, const CharacterVector&)) (&FPS::cluster_butina), 0, &metric_valid<2>)
+    .method("cluster_butina", (DataFrame (FPS::*)(double, int, const CharacterVector&)) (&FPS::cluster_butina))
+    .method("pick_diverse", (DataFrame (FPS::*)(int, int)) (&FPS::pick_diverse))
+    .method("pick_diverse", (DataFrame (FPS::*)(int, int, int)) (&FPS::pick_diverse), 0, &no_metric_valid<3>)
+    .method("pick_diverse", (DataFrame (FPS::*)(int, int, const CharacterVector&)) (&FPS::pick_diverse), 0, &metric_valid<3>)
+    .method("pick_diverse", (DataFrame (FPS::*)(int, int, int, const CharacterVector&)) (&FPS::pick_diverse))
+    .method("tanimoto_subset", (DataFrame (FPS::*)(RObject&, RObject&)) (&FPS::tanimoto_subset))
+    .method("tanimoto_subset", (DataFrame (FPS::*)(RObject&, RObject&, const CharacterVector&)) (&FPS::tanimoto_subset))
+    .method("tanimoto_subset_sparse", (S4 (FPS::*)(RObject&, RObject&, double)) (&FPS::tanimoto_subset_sparse))
+    .method("tanimoto_subset_sparse", (S4 (FPS::*)(RObject&, RObject&, double, const CharacterVector&)) (&FPS::tanimoto_subset_sparse))
+    .method("tanimoto_matrix", (RObject (FPS::*)(RObject&)) (&FPS::tanimoto_matrix))
+    .method("tanimoto_matrix", (RObject (FPS::*)(RObject&, const std::string&)) (&FPS::tanimoto_matrix))
+    .method("tanimoto_matrix", (RObject (FPS::*)(RObject&, const std::string&, const std::string&)) (&FPS::tanimoto_matrix))
+    .method("tanimoto_matrix", (RObject (FPS::*)(RObject&, const std::string&, const std::string&, int)) (&FPS::tanimoto_matrix))
+    .method("tanimoto_matrix", (RObject (FPS::*)(RObject&, const std::string&, const std::string&, int, const CharacterVector&)) (&FPS::tanimoto_matrix))
+    .method("tanimoto_ext", (DataFrame (FPS::*)(const CharacterVector&)) (&FPS::tanimoto_ext))
+    .method("tanimoto_ext", (DataFrame (FPS::*)(const CharacterVector&, double)) (&FPS::tanimoto_ext), 0, &no_metric_valid<2>)
+    .method("tanimoto_ext", (DataFrame (FPS::*)(const CharacterVector&, const CharacterVector&)) (&FPS::tanimoto_ext), 0, &metric_valid<2>)
+    .method("tanimoto_ext", (DataFrame (FPS::*)(const CharacterVector&, double, const CharacterVector&)) (&FPS::tanimoto_ext))
+    .method("tanimoto_topk", (DataFrame (FPS::*)(const CharacterVector&, int)) (&FPS::tanimoto_topk))
+    .method("tanimoto_topk", (DataFrame (FPS::*)(const CharacterVector&, int, int)) (&FPS::tanimoto_topk), 0, &no_metric_valid<3>)
+    .method("tanimoto_topk", (DataFrame (FPS::*)(const CharacterVector&, int, const CharacterVector&)) (&FPS::tanimoto_topk), 0, &metric_valid<3>)
+    .method("tanimoto_topk", (DataFrame (FPS::*)(const CharacterVector&, int, int, const CharacterVector&)) (&FPS::tanimoto_topk))
+    .method("build_vptree", (void (FPS::*)()) (&FPS::build_vptree))
+    .method("build_vptree", (void (FPS::*)(int)) (&FPS::build_vptree))
+    .method("tanimoto_range", (DataFrame (FPS::*)(const CharacterVector&, double)) (&FPS::tanimoto_range))
+    .method("tanimoto_range", (DataFrame (FPS::*)(const CharacterVector&, double, int)) (&FPS::tanimoto_range))
+    .method("build_hnsw", (void (FPS::*)(int, int)) (&FPS::build_hnsw))
+    .method("build_hnsw", (void (FPS::*)(int, int, int)) (&FPS::build_hnsw))
+    .method("save_hnsw", (void (FPS::*)(const std::string&)) (&FPS::save_hnsw))
+    .method("save_hnsw", (void (FPS::*)(const std::string&, int)) (&FPS::save_hnsw))
+    .method("load_hnsw", &FPS::load_hnsw)
+    .method("search_approx", (DataFrame (FPS::*)(const CharacterVector&, int, int)) (&FPS::search_approx))
+    .method("search_approx", (DataFrame (FPS::*)(const CharacterVector&, int, int, int)) (&FPS::search_approx))
+    .method("build_lsh", (void (FPS::*)(int, int)) (&FPS::build_lsh))
+    .method("build_lsh", (void (FPS::*)(int, int, int)) (&FPS::build_lsh))
+    .method("save_lsh", (void (FPS::*)(const std::string&)) (&FPS::save_lsh))
+    .method("save_lsh", (void (FPS::*)(const std::string&, int)) (&FPS::save_lsh))
+    .method("load_lsh", &FPS::load_lsh)
+    .method("tanimoto_lsh", (DataFrame (FPS::*)(const CharacterVector&, double)) (&FPS::tanimoto_lsh))
+    .method("tanimoto_lsh", (DataFrame (FPS::*)(const CharacterVector&, double, int)) (&FPS::tanimoto_lsh), 0, &no_metric_valid<3>)
+    .method("tanimoto_lsh", (DataFrame (FPS::*)(const CharacterVector&, double, const CharacterVector&)) (&FPS::tanimoto_lsh), 0, &metric_valid<3>)
+    .method("tanimoto_lsh", (DataFrame (FPS::*)(const CharacterVector&, double, int, const CharacterVector&)) (&FPS::tanimoto_lsh))
+    .method("screen_superset", (DataFrame (FPS::*)(const CharacterVector&)) (&FPS::screen_superset))
+    .method("screen_superset", (DataFrame (FPS::*)(const CharacterVector&, int)) (&FPS::screen_superset))
+    .method("set_prefilter", &FPS::set_prefilter)
+    .method("set_bitsliced", &FPS::set_bitsliced)
+    .method("save_file", (void (FPS::*)(const std::string&, const int&)) (&FPS::save_file))
+    .method("save_file", (void (FPS::*)(const std::string&, int, int)) (&FPS::save_file))
+    .method("save_file", (void (FPS::*)(const std::string&, int, int, bool)) (&FPS::save_file))
+    .method("save_file", (void (FPS::*)(const std::string&)) (&FPS::save_file))
+    .method("append_file", (void (FPS::*)(const std::string&)) (&FPS::append_file))
+    .method("append_file", (void (FPS::*)(const std::string&, int)) (&FPS::append_file))
+    .method("append_file", (void (FPS::*)(const std::string&, int, int)) (&FPS::append_file))
+    .method("append_file", (void (FPS::*)(const std::string&, int, int, bool)) (&FPS::append_file))
+    .method("save_mapped", &FPS::save_mapped)
+    .field_readonly("fingerprints", &FPS::fps)
+    .field_readonly("names", &FPS::fp_names)
+    ;
+}
+
 // Expose all relevant classes through an Rcpp module
-RCPP_EXPOSED_CLASS(MorganFPS)
+RCPP_EXPOSED_CLASS_NODECL(MorganFPS)
+RCPP_EXPOSED_CLASS_NODECL(MorganFPS1024)
+RCPP_EXPOSED_CLASS_NODECL(MorganFPS4096)
+RCPP_EXPOSED_CLASS_NODECL(MACCSFPS)
 RCPP_MODULE(morgan_cpp) {
 
   using namespace Rcpp;
 
-  class_<MorganFPS>( "MorganFPS" )
-    .constructor<CharacterVector>("Construct fingerprint collection from character vector")
-    .constructor<std::string, bool>("Construct fingerprint collection from binary file", &typed_valid<std::string, bool>)
-    .method("size", &MorganFPS::size)
-    .method("n", &MorganFPS::n)
-    .method("tanimoto", &MorganFPS::tanimoto)
-    .method("tanimoto_all", &MorganFPS::tanimoto_all)
-    .method("tanimoto_threshold", &MorganFPS::tanimoto_threshold)
-    .method("tanimoto_subset", &MorganFPS::tanimoto_subset)
-    .method("tanimoto_ext", &MorganFPS::tanimoto_ext)
-    .method("save_file", (void (MorganFPS::*)(const std::string&, const int&)) (&MorganFPS::save_file))
-    .method("save_file", (void (MorganFPS::*)(const std::string&)) (&MorganFPS::save_file))
-    .field_readonly("fingerprints", &MorganFPS::fps)
-    .field_readonly("names", &MorganFPS::fp_names)
-    ;
+  expose_collection<2048>("MorganFPS");
+  expose_collection<1024>("MorganFPS1024");
+  expose_collection<4096>("MorganFPS4096");
+  expose_collection<167>("MACCSFPS");
 }
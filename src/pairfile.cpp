@@ -0,0 +1,81 @@
+#include <Rcpp.h>
+#include "zstd/zstd.h"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+#include "pairfile.hpp"
+
+using namespace Rcpp;
+
+//' Read pairs written to a file
+//'
+//' Reads the pairs of fingerprints saved by `tanimoto_threshold_file()`
+//' of a fingerprint collection, see [MorganFPS].
+//'
+//' @param path Path to the pair file
+//' @return Dataframe with columns "id_1", "id_2", and "similarity"
+//' @export
+// [[Rcpp::export]]
+DataFrame read_pairs_file(const std::string& path) {
+  std::ifstream in_stream;
+  in_stream.open(path, std::ios::in | std::ios::binary);
+  if (!in_stream)
+    stop("Can't open %s", path);
+
+  char magic[] = "xORGANHIT";
+  in_stream.read(magic, 9);
+  if (strcmp(magic, pair_file_magic) != 0)
+    stop("File is incompatible, doesn't start with 'MORGANHIT': '%s'", magic);
+  std::uint32_t version;
+  in_stream.read(reinterpret_cast<char*>(&version), sizeof(version));
+  if (version != pair_file_version)
+    stop("Unsupported pair file version %i", version);
+  std::uint64_t n;
+  in_stream.read(reinterpret_cast<char*>(&n), sizeof(n));
+
+  IntegerVector id_1(n);
+  IntegerVector id_2(n);
+  NumericVector similarity(n);
+
+  // Frames are decompressed a chunk at a time. Records can be split between
+  // chunks, the incomplete tail is carried over to the start of the next one.
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+  std::vector<char> in_buffer(ZSTD_DStreamInSize());
+  std::vector<PairRecord> records(1 << 16);
+  ZSTD_outBuffer output = {records.data(), records.size() * sizeof(PairRecord), 0};
+  std::uint64_t idx = 0;
+  while (in_stream) {
+    in_stream.read(in_buffer.data(), in_buffer.size());
+    ZSTD_inBuffer input = {in_buffer.data(), static_cast<size_t>(in_stream.gcount()), 0};
+    // A full output buffer means the decoder may hold more data to flush
+    bool output_full = true;
+    while (input.pos < input.size || output_full) {
+      const size_t ret = ZSTD_decompressStream(context.get(), &output, &input);
+      if (ZSTD_isError(ret))
+        stop("Error decompressing pairs: %s", ZSTD_getErrorName(ret));
+      output_full = output.pos == output.size;
+      const size_t n_complete = output.pos / sizeof(PairRecord);
+      if (idx + n_complete > n)
+        stop("Pair file holds more pairs than recorded in its header");
+      for (size_t i = 0; i < n_complete; i++, idx++) {
+        id_1[idx] = records[i].id_1;
+        id_2[idx] = records[i].id_2;
+        similarity[idx] = records[i].similarity;
+      }
+      const size_t tail = output.pos - n_complete * sizeof(PairRecord);
+      std::memmove(records.data(), records.data() + n_complete, tail);
+      output.pos = tail;
+    }
+  }
+  if (idx != n || output.pos != 0)
+    stop("Pair file is truncated, expected %i pairs but found %i", n, idx);
+
+  return DataFrame::create(
+    Named("id_1") = id_1,
+    Named("id_2") = id_2,
+    Named("similarity") = similarity
+  );
+}
@@ -0,0 +1,121 @@
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "zstd/zstd.h"
+#include "utils.hpp"
+
+#ifndef MORGANCPP_PAIRFILE_H
+#define MORGANCPP_PAIRFILE_H
+
+
+// Pair of fingerprint names and their similarity as stored in pair files
+struct PairRecord {
+  FingerprintName id_1;
+  FingerprintName id_2;
+  double similarity;
+};
+
+static_assert(sizeof(PairRecord) == 16, "Pair records must be packed");
+
+// Pair files start with "MORGANHIT", a format version and the number of
+// pairs, followed by zstd frames of PairRecords
+const char pair_file_magic[] = "MORGANHIT";
+const std::uint32_t pair_file_version = 1;
+const size_t pair_file_count_offset = 9 + sizeof(std::uint32_t);
+
+// Writes pairs found by several workers to a pair file. Every worker collects
+// pairs in its own buffer and compresses it into a separate zstd frame once it
+// is full, so memory use is bounded by the buffers no matter how many pairs
+// are written. Only writing the compressed frame to the file is serialized.
+//
+// Called from worker threads, so errors are thrown as std::runtime_error
+// rather than through the R API.
+class PairFileWriter {
+
+public:
+
+  PairFileWriter(const std::string& path, int n_workers, int compression_level)
+    : buffers(n_workers), compression_level(compression_level), n_pairs(0) {
+    out_stream.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out_stream)
+      throw std::runtime_error("Can't open " + path + " for writing");
+    std::uint64_t n = 0;
+    out_stream.write(pair_file_magic, 9);
+    out_stream.write(reinterpret_cast<const char*>(&pair_file_version), sizeof(pair_file_version));
+    out_stream.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    for (auto& b: buffers) {
+      b.records.reserve(buffer_size);
+      b.context.reset(ZSTD_createCCtx());
+    }
+  }
+
+  void push_back(int worker, FingerprintName id_1, FingerprintName id_2, double similarity) {
+    WorkerBuffer& b = buffers[worker];
+    b.records.push_back(PairRecord{id_1, id_2, similarity});
+    if (b.records.size() == buffer_size)
+      flush(b);
+  }
+
+  // Write the remaining pairs and record their number in the header
+  std::uint64_t close() {
+    for (auto& b: buffers)
+      flush(b);
+    std::uint64_t n = n_pairs;
+    out_stream.seekp(pair_file_count_offset);
+    out_stream.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    out_stream.close();
+    if (out_stream.fail())
+      throw std::runtime_error("Error writing pair file");
+    return n;
+  }
+
+private:
+
+  // 1MB of pairs per worker
+  static constexpr size_t buffer_size = 1 << 16;
+
+  struct ContextDeleter {
+    void operator()(ZSTD_CCtx* ctx) const { ZSTD_freeCCtx(ctx); }
+  };
+
+  struct WorkerBuffer {
+    std::vector<PairRecord> records;
+    std::vector<char> compressed;
+    std::unique_ptr<ZSTD_CCtx, ContextDeleter> context;
+  };
+
+  void flush(WorkerBuffer& b) {
+    if (b.records.empty())
+      return;
+    const size_t input_size = b.records.size() * sizeof(PairRecord);
+    b.compressed.resize(ZSTD_compressBound(input_size));
+    const size_t compressed_size = ZSTD_compressCCtx(
+      b.context.get(), b.compressed.data(), b.compressed.size(),
+      b.records.data(), input_size, compression_level
+    );
+    if (ZSTD_isError(compressed_size))
+      throw std::runtime_error(std::string("Error compressing pairs: ") + ZSTD_getErrorName(compressed_size));
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      out_stream.write(b.compressed.data(), compressed_size);
+      if (out_stream.fail())
+        throw std::runtime_error("Error writing pair file");
+    }
+    n_pairs += b.records.size();
+    b.records.clear();
+  }
+
+  std::vector<WorkerBuffer> buffers;
+  int compression_level;
+  std::atomic<std::uint64_t> n_pairs;
+  std::ofstream out_stream;
+  std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#ifndef MORGANCPP_PAIRS_H
+#define MORGANCPP_PAIRS_H
+
+
+// Pairs of fingerprint positions together with their similarity
+struct PairHits {
+  std::vector<std::uint32_t> i;
+  std::vector<std::uint32_t> j;
+  std::vector<double> similarity;
+
+  void reserve(size_t n) {
+    i.reserve(n);
+    j.reserve(n);
+    similarity.reserve(n);
+  }
+
+  void push_back(std::uint32_t a, std::uint32_t b, double sim) {
+    i.push_back(a);
+    j.push_back(b);
+    similarity.push_back(sim);
+  }
+
+  size_t size() const {
+    return i.size();
+  }
+};
+
+// Hits of a search split into tiles. Every worker appends to its own buffer
+// and records which range of the buffer belongs to which tile, so the buffers
+// can be merged in tile order once all workers are done.
+struct TiledPairs {
+  struct Segment {
+    int worker;
+    size_t begin;
+    size_t end;
+  };
+
+  std::vector<PairHits> buffers;
+  std::vector<Segment> segments;
+
+  TiledPairs(size_t n_tiles, int n_workers, size_t reserve_per_worker)
+    : buffers(n_workers), segments(n_tiles, Segment{0, 0, 0}) {
+    for (auto& b: buffers)
+      b.reserve(reserve_per_worker);
+  }
+
+  size_t size() const {
+    size_t n = 0;
+    for (auto& b: buffers)
+      n += b.size();
+    return n;
+  }
+
+  // Call f(i, j, similarity) for every hit in tile order
+  template <typename F>
+  void for_each(F f) const {
+    for (auto& s: segments) {
+      const PairHits& b = buffers[s.worker];
+      for (size_t k = s.begin; k < s.end; k++)
+        f(b.i[k], b.j[k], b.similarity[k]);
+    }
+  }
+
+  // Call f(i, j, similarity) for every hit ordered by i and then j, where
+  // i < n. Hits are bucketed by i and every bucket is sorted by j.
+  template <typename F>
+  void for_each_sorted(size_t n, F f) const {
+    std::vector<size_t> offsets(n + 1, 0);
+    for_each([&](std::uint32_t i, std::uint32_t, double) { offsets[i + 1]++; });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<std::pair<std::uint32_t, double>> rows(offsets[n]);
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for_each([&](std::uint32_t i, std::uint32_t j, double sim) {
+      rows[next[i]++] = std::make_pair(j, sim);
+    });
+    for (size_t i = 0; i < n; i++) {
+      std::sort(rows.begin() + offsets[i], rows.begin() + offsets[i + 1]);
+      for (size_t k = offsets[i]; k < offsets[i + 1]; k++)
+        f(static_cast<std::uint32_t>(i), rows[k].first, rows[k].second);
+    }
+  }
+};
+
+// Neighbours of every fingerprint in compressed sparse row form. The
+// neighbours of fingerprint i are ids[offsets[i]:offsets[i + 1]].
+struct NeighbourLists {
+  std::vector<size_t> offsets;
+  std::vector<std::uint32_t> ids;
+
+  // Both directions of every pair (i, j) in the per worker pair buffers
+  NeighbourLists(size_t n, const std::vector<std::vector<std::pair<std::uint32_t, std::uint32_t>>>& pairs)
+    : offsets(n + 1, 0) {
+    for (auto& buffer: pairs) {
+      for (auto& p: buffer) {
+        offsets[p.first + 1]++;
+        offsets[p.second + 1]++;
+      }
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    ids.resize(offsets[n]);
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (auto& buffer: pairs) {
+      for (auto& p: buffer) {
+        ids[next[p.first]++] = p.second;
+        ids[next[p.second]++] = p.first;
+      }
+    }
+  }
+
+  size_t degree(size_t i) const {
+    return offsets[i + 1] - offsets[i];
+  }
+};
+
+// Square tiles covering the upper triangle of an n x n matrix, without
+// the diagonal. Tiles on the diagonal only hold half as many pairs.
+struct TriangleTiles {
+  size_t n;
+  size_t block;
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> blocks;
+
+  // Tiles of at most 1024 fingerprints per side keep the row and column block
+  // in L2 cache, while smaller collections are still split in enough tiles to
+  // balance them over all workers
+  TriangleTiles(size_t n, int n_threads) : n(n) {
+    block = std::min<size_t>(1024, std::max<size_t>(64, n / (4 * n_threads)));
+    const size_t n_blocks = (n + block - 1) / block;
+    blocks.reserve(n_blocks * (n_blocks + 1) / 2);
+    for (size_t r = 0; r < n_blocks; r++)
+      for (size_t c = r; c < n_blocks; c++)
+        blocks.emplace_back(r, c);
+  }
+
+  size_t size() const {
+    return blocks.size();
+  }
+
+  size_t row_begin(size_t tile) const { return blocks[tile].first * block; }
+  size_t row_end(size_t tile) const { return std::min(n, row_begin(tile) + block); }
+  size_t col_begin(size_t tile) const { return blocks[tile].second * block; }
+  size_t col_end(size_t tile) const { return std::min(n, col_begin(tile) + block); }
+};
+
+#endif
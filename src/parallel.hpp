@@ -0,0 +1,82 @@
+#include <Rcpp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef MORGANCPP_PARALLEL_H
+#define MORGANCPP_PARALLEL_H
+
+
+// Number of worker threads used when the caller doesn't ask for a specific number
+inline int default_n_threads() {
+  unsigned int n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : static_cast<int>(n);
+}
+
+// Run task(i, worker) for every i in [0, n_tasks) on up to n_threads worker
+// threads. Tasks are handed out one at a time so uneven tasks balance.
+//
+// Tasks run outside of the R main thread, so they must not call any R API,
+// including Rcpp::stop(). Throw a std::exception instead, it is rethrown on
+// the main thread once all workers have stopped. The main thread waits for the
+// workers and checks for user interrupts in the meantime.
+template <typename Task>
+void parallel_for(size_t n_tasks, int n_threads, Task task) {
+  if (n_threads < 1)
+    Rcpp::stop("Number of threads must be positive");
+  if (n_tasks == 0)
+    return;
+  const size_t n_workers = std::min(static_cast<size_t>(n_threads), n_tasks);
+
+  std::atomic<size_t> next_task(0);
+  std::atomic<bool> abort(false);
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable finished;
+  size_t running = n_workers;
+
+  auto worker = [&](int w) {
+    try {
+      for (size_t i = next_task++; i < n_tasks && !abort; i = next_task++)
+        task(i, w);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error)
+        error = std::current_exception();
+      abort = true;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    running--;
+    finished.notify_all();
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(n_workers);
+  for (size_t w = 0; w < n_workers; w++)
+    threads.emplace_back(worker, static_cast<int>(w));
+
+  try {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!finished.wait_for(lock, std::chrono::milliseconds(100), [&]{ return running == 0; })) {
+      lock.unlock();
+      Rcpp::checkUserInterrupt();
+      lock.lock();
+    }
+  } catch (...) {
+    abort = true;
+    for (auto& t: threads)
+      t.join();
+    throw;
+  }
+  for (auto& t: threads)
+    t.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+#endif
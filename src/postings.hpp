@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#ifndef MORGANCPP_POSTINGS_H
+#define MORGANCPP_POSTINGS_H
+
+
+// Inverted index from every bit to the positions of the fingerprints that
+// have it set, in increasing order. Lists are stored back to back, the list
+// of bit b is ids[offsets[b]:offsets[b + 1]].
+struct BitPostings {
+  std::vector<size_t> offsets;
+  std::vector<std::uint32_t> ids;
+
+  bool empty() const {
+    return offsets.empty();
+  }
+
+  template <typename Fps>
+  void build(const Fps& fps) {
+    using Fp = typename Fps::value_type;
+    const size_t n_bits = sizeof(Fp) * 8;
+    offsets.assign(n_bits + 1, 0);
+    auto for_each_bit = [](const Fp& fp, auto f) {
+      for (size_t w = 0; w < fp.size(); w++) {
+        for (std::uint64_t x = fp[w]; x != 0; x &= x - 1)
+          f(w * 64 + __builtin_ctzll(x));
+      }
+    };
+    for (auto& fp: fps)
+      for_each_bit(fp, [&](size_t b) { offsets[b + 1]++; });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    ids.resize(offsets[n_bits]);
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < fps.size(); i++)
+      for_each_bit(fps[i], [&](size_t b) { ids[next[b]++] = i; });
+  }
+
+  size_t length(size_t bit) const {
+    return offsets[bit + 1] - offsets[bit];
+  }
+
+  const std::uint32_t* begin(size_t bit) const {
+    return ids.data() + offsets[bit];
+  }
+
+  const std::uint32_t* end(size_t bit) const {
+    return ids.data() + offsets[bit + 1];
+  }
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "kernels.hpp"
+
+#ifndef MORGANCPP_PREFILTER_H
+#define MORGANCPP_PREFILTER_H
+
+
+// Fingerprints folded to W 64 bit words by OR-ing word w into word w % W,
+// used to skip pairs that can't reach a threshold before reading the full
+// fingerprints. The summaries are stored next to each other, 16 or 32 bytes
+// per fingerprint, so a scan over them stays in cache much longer than one
+// over the fingerprints themselves.
+//
+// Every bit set in the summary of a but not in the summary of b stands for at
+// least one bit of a that is missing from b, so the number of shared bits is
+// bounded by c <= min(a - |Fa & ~Fb|, b - |Fb & ~Fa|), where
+// |Fa & ~Fb| = |Fa| - |Fa & Fb|.
+template <size_t W>
+class FoldedSummaries {
+public:
+  static constexpr bool enabled = true;
+  using Words = std::array<std::uint64_t, W>;
+
+  struct Summary {
+    Words words;
+    int count;
+  };
+
+  FoldedSummaries() : count_and(popcount_kernels<W>().count_and) {}
+
+  template <typename Fps>
+  void build(const Fps& fps) {
+    folds.resize(fps.size());
+    counts.resize(fps.size());
+    for (size_t i = 0; i < fps.size(); i++) {
+      const Summary s = fold(fps[i]);
+      folds[i] = s.words;
+      counts[i] = s.count;
+    }
+  }
+
+  void clear() {
+    folds.clear();
+    folds.shrink_to_fit();
+    counts.clear();
+    counts.shrink_to_fit();
+  }
+
+  template <typename Fp>
+  Summary fold(const Fp& fp) const {
+    Summary s;
+    s.words.fill(0);
+    for (size_t w = 0; w < fp.size(); w++)
+      s.words[w % W] |= fp[w];
+    s.count = popcount_kernels<W>().count(s.words);
+    return s;
+  }
+
+  Summary summary(size_t i) const {
+    return Summary{folds[i], counts[i]};
+  }
+
+  // Upper bound on the bits shared by a query with summary q and a bits set
+  // and fingerprint j with b bits set
+  int shared_bound(const Summary& q, int a, size_t j, int b) const {
+    const int shared = count_and(q.words, folds[j]);
+    return std::min(a - q.count + shared, b - counts[j] + shared);
+  }
+
+private:
+  int (*count_and)(const Words& f1, const Words& f2);
+  std::vector<Words> folds;
+  std::vector<int> counts;
+};
+
+// Stand-in used when no prefilter is set, compiled away in the search loops
+struct NoPrefilter {
+  static constexpr bool enabled = false;
+
+  struct Summary {};
+
+  template <typename Fp>
+  Summary fold(const Fp& fp) const {
+    return Summary();
+  }
+
+  Summary summary(size_t i) const {
+    return Summary();
+  }
+
+  int shared_bound(const Summary& q, int a, size_t j, int b) const {
+    return std::min(a, b);
+  }
+};
+
+#endif
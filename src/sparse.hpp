@@ -0,0 +1,76 @@
+#include <Rcpp.h>
+#include <climits>
+#include <string>
+#include <vector>
+
+#ifndef MORGANCPP_SPARSE_H
+#define MORGANCPP_SPARSE_H
+
+
+// Sparse matrix in compressed column format, the layout of Matrix::dgCMatrix.
+// Row indices of column j are i[p[j]:p[j + 1]].
+struct CompressedColumns {
+  size_t n_rows;
+  size_t n_cols;
+  std::vector<int> p;
+  std::vector<int> i;
+  std::vector<double> x;
+};
+
+// Compressed columns from n entries visited in any order. for_each(f) has to
+// call f(row, col, x) for every entry, it is called twice. Entries are
+// bucketed by row and then by column with two counting sorts, so that row
+// indices end up sorted within every column without a comparison sort.
+template <typename ForEach>
+CompressedColumns compress_columns(size_t n_rows, size_t n_cols, size_t n, ForEach for_each) {
+  if (n > INT_MAX)
+    Rcpp::stop("Too many entries for a sparse matrix: %i", n);
+  std::vector<size_t> row_offsets(n_rows + 1, 0);
+  CompressedColumns m{n_rows, n_cols, std::vector<int>(n_cols + 1, 0), std::vector<int>(n), std::vector<double>(n)};
+  for_each([&](size_t row, size_t col, double x) {
+    row_offsets[row + 1]++;
+    m.p[col + 1]++;
+  });
+  std::partial_sum(row_offsets.begin(), row_offsets.end(), row_offsets.begin());
+  std::partial_sum(m.p.begin(), m.p.end(), m.p.begin());
+  // Entries ordered by row
+  std::vector<int> by_row_col(n);
+  std::vector<double> by_row_x(n);
+  for_each([&](size_t row, size_t col, double x) {
+    const size_t k = row_offsets[row]++;
+    by_row_col[k] = col;
+    by_row_x[k] = x;
+  });
+  // Distribute them over columns, visiting rows in order
+  std::vector<int> next(m.p.begin(), m.p.end() - 1);
+  size_t k = 0;
+  for (size_t row = 0; row < n_rows; row++) {
+    for (; k < row_offsets[row]; k++) {
+      const int idx = next[by_row_col[k]]++;
+      m.i[idx] = row;
+      m.x[idx] = by_row_x[k];
+    }
+  }
+  return m;
+}
+
+// Matrix::dgCMatrix, or Matrix::dsCMatrix holding the upper triangle of a
+// symmetric matrix
+inline Rcpp::S4 sparse_matrix(
+    const CompressedColumns& m, const Rcpp::CharacterVector& row_names,
+    const Rcpp::CharacterVector& col_names, bool symmetric
+) {
+  // Loads the Matrix namespace so that its classes are defined
+  Rcpp::Environment::namespace_env("Matrix");
+  Rcpp::S4 out(symmetric ? "dsCMatrix" : "dgCMatrix");
+  out.slot("i") = Rcpp::IntegerVector(m.i.begin(), m.i.end());
+  out.slot("p") = Rcpp::IntegerVector(m.p.begin(), m.p.end());
+  out.slot("x") = Rcpp::NumericVector(m.x.begin(), m.x.end());
+  out.slot("Dim") = Rcpp::IntegerVector::create(static_cast<int>(m.n_rows), static_cast<int>(m.n_cols));
+  out.slot("Dimnames") = Rcpp::List::create(row_names, col_names);
+  if (symmetric)
+    out.slot("uplo") = "U";
+  return out;
+}
+
+#endif
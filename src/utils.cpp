@@ -4,7 +4,9 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <new>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 
 #include "utils.hpp"
@@ -99,13 +101,20 @@ int parse_hex_char(const char& c) {
   return v;
 }
 
-// Convert raw byte string to fingerprint.
-Fingerprint raw2fp(const std::string& raw) {
-  if (raw.length() != 256) {
-    ::Rf_error("Input raw string must be of length 256");
+// Convert raw byte string to fingerprint. Lengths that aren't a multiple of
+// 8 bits are padded to whole bytes, the padding bits have to be unset.
+template <size_t n_bits>
+FingerprintOf<n_bits> raw2fp(const std::string& raw) {
+  const size_t n_bytes = (n_bits + 7) / 8;
+  if (raw.length() != n_bytes) {
+    ::Rf_error("Input raw string must be of length %i", static_cast<int>(n_bytes));
   }
-  Fingerprint fp;
-  std::memcpy(fp.data(), &raw[0], sizeof(fp));
+  if (n_bits % 8 != 0 && static_cast<unsigned char>(raw[n_bytes - 1]) >> (n_bits % 8) != 0) {
+    ::Rf_error("Input sets bits beyond the fingerprint length of %i", static_cast<int>(n_bits));
+  }
+  FingerprintOf<n_bits> fp;
+  fp.fill(0);
+  std::memcpy(fp.data(), &raw[0], n_bytes);
   return fp;
 }
 
@@ -140,11 +149,13 @@ std::string hex2raw(const std::string& hex_string) {
 }
 
 // Convert ASCII hex string to fingerprint.
-Fingerprint hex2fp(const std::string& hex) {
-  if (hex.length() != 512) {
-    ::Rf_error("Input hex string must be of length 512");
+template <size_t n_bits>
+FingerprintOf<n_bits> hex2fp(const std::string& hex) {
+  const size_t n_chars = (n_bits + 7) / 8 * 2;
+  if (hex.length() != n_chars) {
+    ::Rf_error("Input hex string must be of length %i", static_cast<int>(n_chars));
   }
-  return raw2fp(hex2raw(hex));
+  return raw2fp<n_bits>(hex2raw(hex));
 }
 
 // From https://github.com/rdkit/rdkit/blob/78aac3c1bcc8f652053fdab26e5fe835fdaea53b/Code/RDGeneral/StreamOps.h#L143
@@ -212,18 +223,23 @@ uint32_t readPackedIntFromStream(std::stringstream &ss) {
   return num;
 }
 
-inline void fp_set_bit(Fingerprint& fp, const size_t i) {
+template <size_t n_bits>
+inline void fp_set_bit(FingerprintOf<n_bits>& fp, const size_t i) {
+  if (i >= n_bits) {
+    throw std::runtime_error("bit index beyond fingerprint length");
+  }
   const size_t j = i / 64;
   const size_t k = i % 64;
   fp[j] |= (UINT64_C(1) << k);
 }
 
 // From https://github.com/rdkit/rdkit/blob/06027dcd05674787b61f27ba46ec0d42a6037540/Code/DataStructs/BitVect.cpp#L23
-Fingerprint rdkit2fp(const std::string& hex) {
+template <size_t n_bits>
+FingerprintOf<n_bits> rdkit2fp(const std::string& hex) {
   auto raw = hex2raw(hex);
   std::stringstream ss(raw);
 
-  Fingerprint fp;
+  FingerprintOf<n_bits> fp;
   fp.fill(0);
   std::int32_t format = 0;
   std::uint32_t nOn = 0;
@@ -257,20 +273,20 @@ Fingerprint rdkit2fp(const std::string& hex) {
     std::uint32_t tmp;
     for (unsigned int i = 0; i < nOn; i++) {
       ss.read(reinterpret_cast<char*>(&tmp), sizeof(tmp));
-      fp_set_bit(fp, tmp);
+      fp_set_bit<n_bits>(fp, tmp);
     }
   } else if (format == 1) {  // version 16 and on bits stored as short ints
     std::uint16_t tmp;
     for (unsigned int i = 0; i < nOn; i++) {
       ss.read(reinterpret_cast<char*>(&tmp), sizeof(tmp));
-      fp_set_bit(fp, tmp);
+      fp_set_bit<n_bits>(fp, tmp);
     }
   } else if (format == 2) {  // run length encoded format
     std::uint32_t curr = 0;
     for (unsigned int i = 0; i < nOn; i++) {
       curr += readPackedIntFromStream(ss);
       // Rcpp::Rcout << "Offset: " << curr << std::endl;
-      fp_set_bit(fp, curr);
+      fp_set_bit<n_bits>(fp, curr);
       curr++;
     }
   }
@@ -289,16 +305,39 @@ std::string guess_fp_format(const Rcpp::CharacterVector& fps_hex) {
   return format;
 }
 
-std::function<Fingerprint (const std::string&)> select_fp_reader(const std::string& format) {
+template <size_t n_bits>
+std::function<FingerprintOf<n_bits> (const std::string&)> select_fp_reader(const std::string& format) {
   if (format == "full") {
-    return hex2fp;
+    return hex2fp<n_bits>;
   } else if (format == "rle") {
-    return rdkit2fp;
+    return rdkit2fp<n_bits>;
   } else {
     Rcpp::stop("Unknown format");
   }
 }
 
+// Lengths of all fingerprint collections: MACCS keys (167 bits) and
+// Morgan fingerprints of 1024, 2048 and 4096 bits
+template std::function<FingerprintOf<167> (const std::string&)> select_fp_reader<167>(const std::string& format);
+template std::function<FingerprintOf<1024> (const std::string&)> select_fp_reader<1024>(const std::string& format);
+template std::function<FingerprintOf<2048> (const std::string&)> select_fp_reader<2048>(const std::string& format);
+template std::function<FingerprintOf<4096> (const std::string&)> select_fp_reader<4096>(const std::string& format);
+
+// Number of bits of a fingerprint in the given format: four per hex digit for
+// full fingerprints, as recorded in the header for RDKit pickles
+size_t fp_bits(const std::string& hex, const std::string& format) {
+  if (format != "rle")
+    return hex.length() * 4;
+  std::stringstream ss(hex2raw(hex.substr(0, 16)));
+  std::int32_t size = 0;
+  ss.read(reinterpret_cast<char*>(&size), sizeof(size));
+  if (size < 0)
+    ss.read(reinterpret_cast<char*>(&size), sizeof(size));
+  if (!ss || size < 0)
+    throw std::runtime_error("invalid BitVect pickle");
+  return size;
+}
+
 
 size_t zstd_frame_decompress(
     std::ifstream &in_stream, size_t &compressed_size, char* out_buffer,
@@ -347,3 +386,58 @@ size_t zstd_frame_decompress(
 
   return decompressed_size;
 };
+
+void zstd_write_block(
+    std::ofstream& out_stream, const char* data, size_t size, int compression_level
+) {
+  std::vector<char> out_buffer(ZSTD_compressBound(size));
+  const size_t compressed = ZSTD_compress(
+    out_buffer.data(), out_buffer.size(), data, size, compression_level
+  );
+  if (ZSTD_isError(compressed))
+    Rcpp::stop("Error compressing: %s", ZSTD_getErrorName(compressed));
+  out_stream.write(reinterpret_cast<const char*>(&compressed), sizeof(size_t));
+  out_stream.write(out_buffer.data(), compressed);
+}
+
+void zstd_read_block(std::ifstream& in_stream, char* out_buffer, size_t size) {
+  size_t compressed;
+  in_stream.read(reinterpret_cast<char*>(&compressed), sizeof(size_t));
+  if (!in_stream)
+    Rcpp::stop("File is truncated");
+  zstd_frame_decompress(in_stream, compressed, out_buffer, size);
+}
+
+ChunkCompressor::ChunkCompressor(int compression_level, bool long_distance) {
+  cctx = ZSTD_createCCtx();
+  if (cctx == nullptr)
+    throw std::bad_alloc();
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, compression_level);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, long_distance ? 1 : 0);
+}
+
+ChunkCompressor::~ChunkCompressor() {
+  ZSTD_freeCCtx(cctx);
+}
+
+size_t ChunkCompressor::compress(const char* data, size_t size) {
+  if (buffer.size() < ZSTD_compressBound(size))
+    buffer.resize(ZSTD_compressBound(size));
+  const size_t compressed = ZSTD_compress2(cctx, buffer.data(), buffer.size(), data, size);
+  if (ZSTD_isError(compressed))
+    throw std::runtime_error(std::string("Error compressing: ") + ZSTD_getErrorName(compressed));
+  return compressed;
+}
+
+void zstd_decompress_chunk(
+    const char* compressed, size_t compressed_size, char* out_buffer, size_t size
+) {
+  const unsigned long long content_size = ZSTD_getFrameContentSize(compressed, compressed_size);
+  if (content_size != size)
+    throw std::runtime_error("Chunk doesn't decompress to the expected size");
+  const size_t decompressed = ZSTD_decompress(out_buffer, size, compressed, compressed_size);
+  if (ZSTD_isError(decompressed))
+    throw std::runtime_error(std::string("Error decompressing: ") + ZSTD_getErrorName(decompressed));
+  if (decompressed != size)
+    throw std::runtime_error("Chunk doesn't decompress to the expected size");
+}
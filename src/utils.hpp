@@ -1,5 +1,8 @@
 #include <Rcpp.h>
 #include <array>
+#include <cstdint>
+#include <fstream>
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -7,7 +10,10 @@
 #define MORGANCPP_UTILS_H
 
 
-using Fingerprint = std::array<std::uint64_t, 32>;
+// Fingerprint of n_bits bits, stored in whole 64 bit words
+template <size_t n_bits>
+using FingerprintOf = std::array<std::uint64_t, (n_bits + 63) / 64>;
+using Fingerprint = FingerprintOf<2048>;
 using FingerprintName = std::int32_t;
 using FingerprintN = std::uint64_t;
 
@@ -32,14 +38,76 @@ std::vector<FingerprintName> convert_name_vec(RObject& names);
 std::vector<size_t> sort_indices(std::vector<FingerprintName>& unsorted_names);
 std::vector<FingerprintName> convert_sort_name_vec(RObject& names);
 int parse_hex_char(const char& c);
-Fingerprint raw2fp(const std::string& raw);
-Fingerprint hex2fp(const std::string& hex);
-Fingerprint rdkit2fp(const std::string& hex);
+// Parsers for fingerprints of n_bits bits, instantiated in utils.cpp for the
+// lengths of all fingerprint collections
+template <size_t n_bits>
+FingerprintOf<n_bits> raw2fp(const std::string& raw);
+template <size_t n_bits>
+FingerprintOf<n_bits> hex2fp(const std::string& hex);
+template <size_t n_bits>
+FingerprintOf<n_bits> rdkit2fp(const std::string& hex);
 std::string guess_fp_format(const CharacterVector& fps_hex);
-std::function<Fingerprint (const std::string&)> select_fp_reader(const std::string& format);
+template <size_t n_bits>
+std::function<FingerprintOf<n_bits> (const std::string&)> select_fp_reader(const std::string& format);
+size_t fp_bits(const std::string& hex, const std::string& format);
 size_t zstd_frame_decompress(
     std::ifstream &in_stream, size_t &compressed_size, char* out_buffer,
     size_t &out_buffer_size
 );
+// Blocks of an index file, the compressed size followed by one zstd frame
+void zstd_write_block(
+    std::ofstream& out_stream, const char* data, size_t size, int compression_level
+);
+void zstd_read_block(std::ifstream& in_stream, char* out_buffer, size_t size);
+// Chunks compressed as independent zstd frames, so that they can be handled
+// on worker threads. Both throw std::runtime_error rather than calling stop().
+//
+// A compressor keeps its context and output buffer from chunk to chunk, so
+// memory stays bounded by the chunk size however much is compressed. Long
+// distance matching finds repeats further apart than the regular window.
+class ChunkCompressor {
+
+public:
+
+  ChunkCompressor(int compression_level, bool long_distance);
+  ~ChunkCompressor();
+  ChunkCompressor(const ChunkCompressor&) = delete;
+  ChunkCompressor& operator=(const ChunkCompressor&) = delete;
+
+  // Compress data into a frame, returns its size. The frame is at data()
+  // until the next call.
+  size_t compress(const char* data, size_t size);
+
+  const char* data() const {
+    return buffer.data();
+  }
+
+private:
+
+  struct ZSTD_CCtx_s* cctx;
+  std::vector<char> buffer;
+};
+void zstd_decompress_chunk(
+    const char* compressed, size_t compressed_size, char* out_buffer, size_t size
+);
+
+// splitmix64 finalizer
+inline std::uint64_t mix64(std::uint64_t x) {
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// Hash of all fingerprints of a collection, recorded in index files to check
+// that an index is loaded for the fingerprints it was built from
+template <typename Fps>
+std::uint64_t fingerprints_checksum(const Fps& fps) {
+  std::uint64_t h = fps.size();
+  for (auto& fp: fps)
+    for (auto x: fp)
+      h = mix64(h ^ x);
+  return h;
+}
 
 #endif
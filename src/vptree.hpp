@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "parallel.hpp"
+#include "utils.hpp"
+
+#ifndef MORGANCPP_VPTREE_H
+#define MORGANCPP_VPTREE_H
+
+
+// Vantage point tree (Yianilos 1993) for exact range searches under a metric,
+// here Tanimoto distance.
+//
+// The tree is stored implicitly in a permutation of the fingerprint
+// positions. A node covering ids[lo:hi] has its vantage point at ids[lo], the
+// points no further than mu[lo] from it in ids[lo + 1:mid] and the points at
+// least mu[lo] away in ids[mid:hi], with mid = lo + 1 + (hi - lo - 1) / 2.
+// Ranges of at most leaf_size points are leaves. The mu of a point in a leaf
+// is its distance to the vantage point of the parent node instead, which is
+// computed while building anyway.
+//
+// By the triangle inequality, a point x inside the ball around vantage point v
+// is at least d(q, v) - mu away from query q, and a point outside it at least
+// mu - d(q, v). Subtrees that can't hold a point within the search radius are
+// skipped, and so are points in leaves with |d(q, v) - d(x, v)| too large.
+class VpTree {
+
+public:
+
+  static const size_t leaf_size = 32;
+
+  std::vector<std::uint32_t> ids;
+  std::vector<double> mu;
+
+  bool empty() const {
+    return ids.empty();
+  }
+
+  size_t size() const {
+    return ids.size() * (sizeof(std::uint32_t) + sizeof(double));
+  }
+
+  // Subtrees are split in parallel once there are enough of them
+  template <typename NodeDist>
+  void build(size_t n, int n_threads, NodeDist node_dist) {
+    ids.resize(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    mu.assign(n, 0.0);
+    std::vector<double> dist(n);
+    std::vector<std::pair<size_t, size_t>> ranges{{0, n}}, next;
+    while (!ranges.empty() && ranges.size() < 4 * static_cast<size_t>(n_threads)) {
+      next.clear();
+      for (auto& r: ranges) {
+        if (r.second - r.first <= leaf_size) {
+          build_range(r.first, r.second, dist, node_dist);
+          continue;
+        }
+        const size_t mid = split(r.first, r.second, dist, node_dist);
+        next.emplace_back(r.first + 1, mid);
+        next.emplace_back(mid, r.second);
+      }
+      ranges.swap(next);
+    }
+    parallel_for(ranges.size(), n_threads, [&](size_t task, int worker) {
+      build_range(ranges[task].first, ranges[task].second, dist, node_dist);
+    });
+  }
+
+  // Calls hit(i) for every point i that may be closer than radius to the
+  // query, which includes every point that is. dist(i) is the distance from
+  // the query to point i.
+  template <typename Dist, typename Hit>
+  void search(Dist dist, double radius, Hit hit) const {
+    // Slack for rounding of the distances, so that no point is lost
+    const double r = radius + 1e-9;
+    // Ranges left to search and the distance from the query to the vantage
+    // point of their parent node
+    struct Range {
+      size_t lo, hi;
+      double parent_dist;
+    };
+    std::vector<Range> stack{{0, ids.size(), 0.0}};
+    while (!stack.empty()) {
+      const Range range = stack.back();
+      const size_t lo = range.lo, hi = range.hi;
+      stack.pop_back();
+      if (hi - lo <= leaf_size) {
+        for (size_t p = lo; p < hi; p++) {
+          if (std::abs(range.parent_dist - mu[p]) < r)
+            hit(ids[p]);
+        }
+        continue;
+      }
+      const size_t mid = lo + 1 + (hi - lo - 1) / 2;
+      const double d = dist(ids[lo]);
+      hit(ids[lo]);
+      if (d - mu[lo] < r)
+        stack.push_back({lo + 1, mid, d});
+      if (mu[lo] - d < r)
+        stack.push_back({mid, hi, d});
+    }
+  }
+
+private:
+
+  template <typename NodeDist>
+  void build_range(size_t lo, size_t hi, std::vector<double>& dist, NodeDist node_dist) {
+    while (hi - lo > leaf_size) {
+      const size_t mid = split(lo, hi, dist, node_dist);
+      build_range(lo + 1, mid, dist, node_dist);
+      lo = mid;
+    }
+    for (size_t p = lo; p < hi; p++)
+      mu[p] = dist[ids[p]];
+  }
+
+  // Pick a vantage point for ids[lo:hi] and partition the rest around the
+  // median distance to it
+  template <typename NodeDist>
+  size_t split(size_t lo, size_t hi, std::vector<double>& dist, NodeDist node_dist) {
+    const size_t vp = lo + mix64(lo ^ (hi << 32)) % (hi - lo);
+    std::swap(ids[lo], ids[vp]);
+    const size_t mid = lo + 1 + (hi - lo - 1) / 2;
+    for (size_t p = lo + 1; p < hi; p++)
+      dist[ids[p]] = node_dist(ids[lo], ids[p]);
+    std::nth_element(
+      ids.begin() + lo + 1, ids.begin() + mid, ids.begin() + hi,
+      [&](std::uint32_t a, std::uint32_t b) { return dist[a] < dist[b]; }
+    );
+    mu[lo] = dist[ids[mid]];
+    return mid;
+  }
+};
+
+#endif